@@ -13,6 +13,7 @@
 #include <ctype.h>
 
 #include "libpq-fe.h"
+#include "libpq/libpq-fs.h"
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -23,6 +24,10 @@
 #define LUASQL_ENVIRONMENT_PG "PostgreSQL environment"
 #define LUASQL_CONNECTION_PG "PostgreSQL connection"
 #define LUASQL_CURSOR_PG "PostgreSQL cursor"
+#define LUASQL_STATEMENT_PG "PostgreSQL statement"
+#define LUASQL_PIPELINE_PG "PostgreSQL pipeline"
+#define LUASQL_PENDING_PG "PostgreSQL pending connection"
+#define LUASQL_LARGEOBJECT_PG "PostgreSQL large object"
 
 typedef struct {
 	short      closed;
@@ -33,23 +38,88 @@ typedef struct {
 	short      closed;
 	int        env;                /* reference to environment */
 	int        auto_commit;        /* 0 for manual commit */
+	int        pending_begin;      /* BEGIN not sent yet in manual commit */
+	int        txn_users;          /* objects sharing the autocommit transaction */
+	int        cur_counter;        /* used to name server-side cursors */
+	int        stmt_counter;       /* used to name prepared statements */
+	int        binary;             /* 1 to receive results in binary format */
+	int        typecache;          /* reference to the type names table */
+	char      *copybuf;            /* buffer to encode and decode COPY data */
+	size_t     copybuf_size;
 	PGconn    *pg_conn;
 } conn_data;
 
 
+/* cursor modes */
+#define CUR_BUFFERED  0            /* the whole result is in pg_res */
+#define CUR_STREAMING 1            /* results are pulled with PQgetResult */
+#define CUR_FINISHED  2            /* streaming cursor got its last result */
+#define CUR_DECLARED  3            /* results are pulled with FETCH */
+
+#define CUR_NAME_SIZE 32
+
+
 typedef struct {
 	short      closed;
+	short      mode;               /* one of the CUR_* modes */
 	int        conn;               /* reference to connection */
 	int        numcols;            /* number of columns */
 	int        colnames, coltypes; /* reference to column information tables */
 	int        curr_tuple;         /* next tuple to be read */
+	conn_data *conn_data;          /* reference to connection for cursor */
 	PGresult  *pg_res;
+	int        batch;              /* rows per FETCH of a declared cursor */
+	short      in_txn;             /* streaming query runs in a transaction */
+	char       name[CUR_NAME_SIZE]; /* name of a declared cursor */
 } cur_data;
 
 
+#define STMT_NAME_SIZE 64         /* NAMEDATALEN */
+
+
+typedef struct {
+	short        closed;
+	int          conn;             /* reference to connection */
+	int          nparams;          /* number of parameters */
+	conn_data   *conn_data;        /* reference to connection for statement */
+	const char **values;           /* parameter buffer, reused by executions */
+	char         name[STMT_NAME_SIZE];
+} stmt_data;
+
+
+typedef struct {
+	short      closed;
+	int        env;                /* reference to environment */
+	PGconn    *pg_conn;
+} pending_data;
+
+
+typedef struct {
+	short      closed;
+	short      own_txn;            /* the object shares txn_users */
+	int        conn;               /* reference to connection */
+	int        fd;                 /* large object descriptor */
+	conn_data *conn_data;          /* reference to connection for object */
+} lo_data;
+
+
+#ifdef LIBPQ_HAS_PIPELINING
+typedef struct {
+	short      closed;
+	int        count;              /* number of queued statements */
+	conn_data *conn_data;          /* reference to connection for pipeline */
+} pipe_data;
+#endif
+
+
 typedef void (*creator) (lua_State *L, cur_data *cur);
 
 
+static void create_colnames (lua_State *L, cur_data *cur);
+static void _pushtable (lua_State *L, cur_data *cur, size_t off, creator func);
+#define pushtable(L,c,m,f) (_pushtable(L,c,offsetof(cur_data,m),f))
+
+
 LUASQL_API int luaopen_luasql_postgres(lua_State *L);
 
 
@@ -75,6 +145,20 @@ static conn_data *getconnection (lua_State *L) {
 }
 
 
+#define TXN_HELD_MSG LUASQL_PREFIX"large objects are open in autocommit mode"
+
+/*
+** Check for a connection which can run statements: in autocommit mode
+** open large objects hold a transaction that other statements would
+** silently join, to be lost with it if any of them failed.
+*/
+static conn_data *getidleconnection (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	luaL_argcheck (L, !conn->auto_commit || conn->txn_users == 0, 1, TXN_HELD_MSG);
+	return conn;
+}
+
+
 /*
 ** Check for valid cursor.
 */
@@ -86,14 +170,183 @@ static cur_data *getcursor (lua_State *L) {
 }
 
 
+/* OIDs of the built-in types decoded from the binary format */
+#define BOOLOID         16
+#define BYTEAOID        17
+#define INT8OID         20
+#define INT2OID         21
+#define INT4OID         23
+#define FLOAT4OID       700
+#define FLOAT8OID       701
+#define TIMESTAMPOID    1114
+#define TIMESTAMPTZOID  1184
+
+/* seconds between 1970-01-01 and 2000-01-01, the PostgreSQL epoch */
+#define PG_EPOCH_OFFSET 946684800.0
+
+
+/*
+** Read a network order 32 bit unsigned integer.
+*/
+static unsigned long get_uint32 (const unsigned char *p) {
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+		((unsigned long)p[2] << 8) | (unsigned long)p[3];
+}
+
+
+/*
+** Read a network order 32 bit signed integer.
+*/
+static long get_int32 (const unsigned char *p) {
+	unsigned long u = get_uint32 (p);
+	return (u & 0x80000000UL) ? -(long)(0xFFFFFFFFUL - u) - 1 : (long)u;
+}
+
+
+/*
+** Read a network order 64 bit signed integer as a double.
+*/
+static double get_int64_number (const unsigned char *p) {
+	return (double)get_int32 (p) * 4294967296.0 + (double)get_uint32 (p + 4);
+}
+
+
+/*
+** Copy a network order floating point value of n bytes to dst.
+*/
+static void get_float (const unsigned char *p, void *dst, size_t n) {
+	unsigned int one = 1;
+	if (*(unsigned char *)&one == 1) {  /* little endian host */
+		unsigned char *d = (unsigned char *)dst;
+		size_t i;
+		for (i = 0; i < n; i++)
+			d[i] = p[n - 1 - i];
+	}
+	else
+		memcpy (dst, p, n);
+}
+
+
+/*
+** Push a value received in binary format, decoding it by its type.
+** Text-like types have the same binary and text representation; values
+** of other types are pushed as the raw bytes sent by the server.
+*/
+static void pushbinary (lua_State *L, Oid type, const char *value, int len) {
+	const unsigned char *p = (const unsigned char *)value;
+	switch (type) {
+		case BOOLOID:
+			if (len == 1) {
+				lua_pushboolean (L, p[0] != 0);
+				return;
+			}
+			break;
+		case INT2OID:
+			if (len == 2) {
+				int v = (p[0] << 8) | p[1];
+				lua_pushinteger (L, (v & 0x8000) ? v - 0x10000 : v);
+				return;
+			}
+			break;
+		case INT4OID:
+			if (len == 4) {
+				lua_pushinteger (L, get_int32 (p));
+				return;
+			}
+			break;
+		case INT8OID:
+			if (len == 8) {
+#if LUA_VERSION_NUM >= 503
+				lua_Unsigned u = 0;
+				int i;
+				for (i = 0; i < 8; i++)
+					u = (u << 8) | p[i];
+				lua_pushinteger (L, (lua_Integer)u);
+#else
+				lua_pushnumber (L, get_int64_number (p));
+#endif
+				return;
+			}
+			break;
+		case FLOAT4OID:
+			if (len == 4 && sizeof (float) == 4) {
+				float f;
+				get_float (p, &f, 4);
+				lua_pushnumber (L, f);
+				return;
+			}
+			break;
+		case FLOAT8OID:
+			if (len == 8 && sizeof (double) == 8) {
+				double d;
+				get_float (p, &d, 8);
+				lua_pushnumber (L, d);
+				return;
+			}
+			break;
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			if (len == 8) {  /* microseconds since 2000-01-01 */
+				lua_pushnumber (L, get_int64_number (p) / 1e6 + PG_EPOCH_OFFSET);
+				return;
+			}
+			break;
+	}
+	lua_pushlstring (L, value, len);
+}
+
+
 /*
 ** Push the value of #i field of #tuple row.
 */
 static void pushvalue (lua_State *L, PGresult *res, int tuple, int i) {
 	if (PQgetisnull (res, tuple, i-1))
 		lua_pushnil (L);
+	else if (PQfformat (res, i-1) == 1)
+		pushbinary (L, PQftype (res, i-1), PQgetvalue (res, tuple, i-1),
+			PQgetlength (res, tuple, i-1));
 	else
-		lua_pushstring (L, PQgetvalue (res, tuple, i-1));
+		lua_pushlstring (L, PQgetvalue (res, tuple, i-1),
+			PQgetlength (res, tuple, i-1));
+}
+
+
+/*
+** Execute a statement, asking for a binary result if the connection
+** is in binary mode.
+*/
+static PGresult *exec_sql (conn_data *conn, const char *sql) {
+	if (conn->binary)
+		return PQexecParams (conn->pg_conn, sql, 0, NULL, NULL, NULL, NULL, 1);
+	return PQexec (conn->pg_conn, sql);
+}
+
+
+/*
+** Discard the pending results of the connection.
+*/
+static void drain_results (PGconn *pg_conn) {
+	PGresult *res;
+	while ((res = PQgetResult (pg_conn)) != NULL)
+		PQclear (res);
+}
+
+
+/*
+** Stop a streaming query before all its rows were read.
+** Outside a transaction the query is cancelled; inside one the rows
+** are read and discarded, since a cancel would abort the transaction.
+*/
+static void cancel_results (conn_data *conn, int in_txn) {
+	if (!in_txn) {
+		char errbuf[256];
+		PGcancel *cancel = PQgetCancel (conn->pg_conn);
+		if (cancel != NULL) {
+			PQcancel (cancel, errbuf, sizeof (errbuf));
+			PQfreeCancel (cancel);
+		}
+	}
+	drain_results (conn->pg_conn);
 }
 
 
@@ -103,6 +356,13 @@ static void pushvalue (lua_State *L, PGresult *res, int tuple, int i) {
 static void cur_nullify (lua_State *L, cur_data *cur) {
 	/* Nullify structure fields. */
 	cur->closed = 1;
+	if (cur->mode == CUR_STREAMING && !cur->conn_data->closed)
+		cancel_results (cur->conn_data, cur->in_txn);
+	if (cur->mode == CUR_DECLARED && !cur->conn_data->closed) {
+		char sql[CUR_NAME_SIZE + 8];
+		sprintf (sql, "CLOSE %s", cur->name);
+		PQclear (PQexec (cur->conn_data->pg_conn, sql));
+	}
 	PQclear(cur->pg_res);
 	luaL_unref (L, LUA_REGISTRYINDEX, cur->conn);
 	luaL_unref (L, LUA_REGISTRYINDEX, cur->colnames);
@@ -111,40 +371,139 @@ static void cur_nullify (lua_State *L, cur_data *cur) {
 
 
 /*
-** Get another row of the given cursor.
+** Fetch the next batch of rows of a declared cursor.
 */
-static int cur_fetch (lua_State *L) {
-	cur_data *cur = getcursor (L);
-	PGresult *res = cur->pg_res;
-	int tuple = cur->curr_tuple;
+static int cur_nextbatch (cur_data *cur) {
+	char sql[CUR_NAME_SIZE + 40];
+	PGresult *res;
+	if (PQntuples (cur->pg_res) < cur->batch)
+		return 0;  /* last batch was not full */
+	sprintf (sql, "FETCH FORWARD %d FROM %s", cur->batch, cur->name);
+	res = exec_sql (cur->conn_data, sql);
+	if (res == NULL)
+		return -1;
+	PQclear (cur->pg_res);
+	cur->pg_res = res;
+	cur->curr_tuple = 0;
+	if (PQresultStatus (res) != PGRES_TUPLES_OK)
+		return -1;
+	return PQntuples (res) > 0;
+}
 
-	if (tuple >= PQntuples(cur->pg_res)) {
-		cur_nullify (L, cur);
-		lua_pushnil(L);  /* no more results */
+
+/*
+** Replace the exhausted result of a streaming or declared cursor by
+** the next one.
+** Return 1 if there are new tuples, 0 at the end of the rows, or -1
+** if the query failed; the failed result is left in pg_res.
+*/
+static int cur_nextresult (cur_data *cur) {
+	PGresult *res;
+	if (cur->mode == CUR_DECLARED)
+		return cur_nextbatch (cur);
+	if (cur->mode != CUR_STREAMING)
+		return 0;
+	while ((res = PQgetResult (cur->conn_data->pg_conn)) != NULL) {
+		switch (PQresultStatus (res)) {
+			case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+			case PGRES_TUPLES_CHUNK:
+#endif
+				PQclear (cur->pg_res);
+				cur->pg_res = res;
+				cur->curr_tuple = 0;
+				return 1;
+			case PGRES_TUPLES_OK:  /* end of the rows */
+				PQclear (res);
+				break;
+			default:
+				PQclear (cur->pg_res);
+				cur->pg_res = res;
+				drain_results (cur->conn_data->pg_conn);
+				cur->mode = CUR_FINISHED;
+				return -1;
+		}
+	}
+	cur->mode = CUR_FINISHED;
+	return 0;
+}
+
+
+/*
+** Check whether the cursor has a row to read, getting the next result
+** of streaming and declared cursors if needed.
+** Return 1 if so, 0 at the end of the rows, or -1 on errors.
+*/
+static int cur_hasrow (cur_data *cur) {
+	if (cur->curr_tuple < PQntuples (cur->pg_res))
 		return 1;
+	return cur_nextresult (cur);
+}
+
+
+/*
+** Close the cursor after its last row or an error, pushing nil or nil
+** and the error message.
+*/
+static int cur_finish (lua_State *L, cur_data *cur, int status) {
+	if (status < 0) {
+		luasql_failmsg (L, "error fetching result. PostgreSQL: ",
+			cur->pg_res && PQresultStatus (cur->pg_res) != PGRES_TUPLES_OK ?
+			PQresultErrorMessage (cur->pg_res) :
+			PQerrorMessage (cur->conn_data->pg_conn));
+		cur_nullify (L, cur);
+		return 2;
+	}
+	cur_nullify (L, cur);
+	lua_pushnil(L);  /* no more results */
+	return 1;
+}
+
+
+/*
+** Copy the current row into the table at index t and advance to the
+** next one.
+*/
+static void cur_pushrow (lua_State *L, cur_data *cur, int t, const char *opts) {
+	PGresult *res = cur->pg_res;
+	int tuple = cur->curr_tuple++;
+	int i;
+	if (strchr (opts, 'n') != NULL)
+		/* Copy values to numerical indices */
+		for (i = 1; i <= cur->numcols; i++) {
+			pushvalue (L, res, tuple, i);
+			lua_rawseti (L, t, i);
+		}
+	if (strchr (opts, 'a') != NULL) {
+		/* Copy values to alphanumerical indices */
+		pushtable (L, cur, colnames, create_colnames);
+		for (i = 1; i <= cur->numcols; i++) {
+			lua_rawgeti (L, -1, i);
+			pushvalue (L, res, tuple, i);
+			lua_rawset (L, t);
+		}
+		lua_pop (L, 1);
 	}
+}
+
+
+/*
+** Get another row of the given cursor.
+*/
+static int cur_fetch (lua_State *L) {
+	cur_data *cur = getcursor (L);
+	int status = cur_hasrow (cur);
 
-	cur->curr_tuple++;
+	if (status <= 0)
+		return cur_finish (L, cur, status);
 	if (lua_istable (L, 2)) {
-		int i;
-		const char *opts = luaL_optstring (L, 3, "n");
-		if (strchr (opts, 'n') != NULL)
-			/* Copy values to numerical indices */
-			for (i = 1; i <= cur->numcols; i++) {
-				pushvalue (L, res, tuple, i);
-				lua_rawseti (L, 2, i);
-			}
-		if (strchr (opts, 'a') != NULL)
-			/* Copy values to alphanumerical indices */
-			for (i = 1; i <= cur->numcols; i++) {
-				lua_pushstring (L, PQfname (res, i-1));
-				pushvalue (L, res, tuple, i);
-				lua_rawset (L, 2);
-			}
+		cur_pushrow (L, cur, 2, luaL_optstring (L, 3, "n"));
 		lua_pushvalue(L, 2);
 		return 1; /* return table */
 	}
 	else {
+		PGresult *res = cur->pg_res;
+		int tuple = cur->curr_tuple++;
 		int i;
 		luaL_checkstack (L, cur->numcols, LUASQL_PREFIX"too many columns");
 		for (i = 1; i <= cur->numcols; i++)
@@ -154,6 +513,37 @@ static int cur_fetch (lua_State *L) {
 }
 
 
+/*
+** Get up to n rows of the given cursor, as tables filled according to
+** the given modes, like fetch.
+** Return an array of rows, which may be shorter than n if the last row
+** was reached, or nil if there are no more rows.
+*/
+static int cur_fetchmany (lua_State *L) {
+	cur_data *cur = getcursor (L);
+	int n = (int)luaL_checkinteger (L, 2);
+	const char *opts = luaL_optstring (L, 3, "n");
+	int status = cur_hasrow (cur);
+	int i;
+
+	luaL_argcheck (L, n > 0, 2, LUASQL_PREFIX"invalid number of rows");
+	if (status <= 0)
+		return cur_finish (L, cur, status);
+	lua_newtable (L);
+	for (i = 1; status > 0; i++) {
+		lua_createtable (L, cur->numcols, 0);
+		cur_pushrow (L, cur, lua_gettop (L), opts);
+		lua_rawseti (L, -2, i);
+		if (i == n)  /* the next call looks for more rows */
+			break;
+		status = cur_hasrow (cur);
+	}
+	if (status < 0)
+		return cur_finish (L, cur, status);
+	return 1;
+}
+
+
 /*
 ** Cursor object collector function
 */
@@ -184,31 +574,115 @@ static int cur_close (lua_State *L) {
 }
 
 
+/* Names of the built-in types, used to prewarm the type cache */
+static const struct {
+	Oid         oid;
+	const char *name;
+} builtin_types[] = {
+	{16, "bool"}, {17, "bytea"}, {18, "char"}, {19, "name"},
+	{20, "int8"}, {21, "int2"}, {23, "int4"}, {25, "text"},
+	{26, "oid"}, {114, "json"}, {142, "xml"}, {700, "float4"},
+	{701, "float8"}, {705, "unknown"}, {1042, "bpchar"},
+	{1043, "varchar"}, {1082, "date"}, {1083, "time"},
+	{1114, "timestamp"}, {1184, "timestamptz"}, {1186, "interval"},
+	{1266, "timetz"}, {1700, "numeric"}, {2950, "uuid"},
+	{3802, "jsonb"},
+	{0, NULL}
+};
+
+
 /*
-** Get the internal database type of the given column.
+** Push the type cache of the connection, a table from type OIDs to
+** type names, creating it with the built-in types if needed.
 */
-static char *getcolumntype (PGconn *conn, PGresult *result, int i, char *buff) {
-	Oid codigo = PQftype (result, i);
-	char stmt[100];
-	PGresult *res;
+static void pushtypecache (lua_State *L, conn_data *conn) {
+	int i;
+	if (conn->typecache != LUA_NOREF) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, conn->typecache);
+		return;
+	}
+	lua_newtable (L);
+	for (i = 0; builtin_types[i].name != NULL; i++) {
+		lua_pushnumber (L, builtin_types[i].oid);
+		lua_pushstring (L, builtin_types[i].name);
+		lua_rawset (L, -3);
+	}
+	lua_pushvalue (L, -1);
+	conn->typecache = luaL_ref (L, LUA_REGISTRYINDEX);
+}
 
-	sprintf (stmt, "select typname from pg_type where oid = %d", codigo);
-	res = PQexec(conn, stmt);
-	strcpy (buff, "undefined");
 
-	if (PQresultStatus (res) == PGRES_TUPLES_OK) {
-		if (PQntuples(res) > 0) {
-			char *name = PQgetvalue(res, 0, 0);
-			if (strcmp (name, "bpchar")==0 || strcmp (name, "varchar")==0) {
-				int modifier = PQfmod (result, i) - 4;
-				sprintf (buff, "%.20s (%d)", name, modifier);
-			}
-			else
-				strncpy (buff, name, 20);
-		}
+/*
+** Add the names of the result column types missing from the type cache
+** on top of the stack, with a single query to pg_type.
+** Nothing is added while another command is in progress, as during a
+** streaming cursor, since no query can be sent then.
+*/
+static void fill_typecache (lua_State *L, conn_data *conn, PGresult *result) {
+	luaL_Buffer b;
+	int cache = lua_gettop (L);
+	int nfields = PQnfields (result);
+	int i, n = 0;
+	Oid *missing;
+	PGresult *res;
+
+	if (conn->closed || nfields == 0
+		|| PQtransactionStatus (conn->pg_conn) == PQTRANS_ACTIVE)
+		return;
+#ifdef LIBPQ_HAS_PIPELINING
+	if (PQpipelineStatus (conn->pg_conn) != PQ_PIPELINE_OFF)
+		return;
+#endif
+	missing = (Oid *)lua_newuserdata (L, nfields * sizeof (Oid));
+	for (i = 0; i < nfields; i++) {
+		Oid oid = PQftype (result, i);
+		lua_pushnumber (L, oid);
+		lua_rawget (L, cache);
+		if (lua_isnil (L, -1))
+			missing[n++] = oid;
+		lua_pop (L, 1);
+	}
+	if (n == 0) {
+		lua_pop (L, 1);
+		return;
 	}
-	PQclear(res);
-	return buff;
+	luaL_buffinit (L, &b);
+	luaL_addstring (&b, "select oid, typname from pg_type where oid in (");
+	for (i = 0; i < n; i++) {
+		char num[16];
+		sprintf (num, "%s%u", i > 0 ? "," : "", (unsigned int)missing[i]);
+		luaL_addstring (&b, num);
+	}
+	luaL_addchar (&b, ')');
+	luaL_pushresult (&b);
+	res = PQexec (conn->pg_conn, lua_tostring (L, -1));
+	lua_pop (L, 2);  /* query and OIDs */
+	if (PQresultStatus (res) == PGRES_TUPLES_OK)
+		for (i = 0; i < PQntuples (res); i++) {
+			lua_pushnumber (L, (lua_Number)strtoul (PQgetvalue (res, i, 0), NULL, 10));
+			lua_pushstring (L, PQgetvalue (res, i, 1));
+			lua_rawset (L, -3);
+		}
+	PQclear (res);
+}
+
+
+/*
+** Push the internal database type of the given column, looked up in
+** the type cache on top of the stack.
+*/
+static void pushcolumntype (lua_State *L, PGresult *result, int i) {
+	const char *name;
+	lua_pushnumber (L, PQftype (result, i));
+	lua_rawget (L, -2);
+	name = lua_tostring (L, -1);
+	if (name == NULL)
+		lua_pushliteral (L, "undefined");
+	else if (strcmp (name, "bpchar")==0 || strcmp (name, "varchar")==0)
+		lua_pushfstring (L, "%s (%d)", name, PQfmod (result, i) - 4);
+	else
+		return;
+	lua_remove (L, -2);
 }
 
 
@@ -231,18 +705,17 @@ static void create_colnames (lua_State *L, cur_data *cur) {
 */
 static void create_coltypes (lua_State *L, cur_data *cur) {
 	PGresult *result = cur->pg_res;
-	conn_data *conn;
-	char typename[100];
 	int i;
-	lua_rawgeti (L, LUA_REGISTRYINDEX, cur->conn);
-	if (!lua_isuserdata (L, -1))
-		luaL_error (L, LUASQL_PREFIX"invalid connection");
-	conn = (conn_data *)lua_touserdata (L, -1);
+	pushtypecache (L, cur->conn_data);
+	fill_typecache (L, cur->conn_data, result);
 	lua_newtable (L);
 	for (i = 1; i <= cur->numcols; i++) {
-		lua_pushstring(L, getcolumntype (conn->pg_conn, result, i-1, typename));
-		lua_rawseti (L, -2, i);
+		lua_pushvalue (L, -2);
+		pushcolumntype (L, result, i-1);
+		lua_rawseti (L, -3, i);
+		lua_pop (L, 1);
 	}
+	lua_remove (L, -2);
 }
 
 
@@ -262,7 +735,6 @@ static void _pushtable (lua_State *L, cur_data *cur, size_t off, creator func) {
 		*ref = luaL_ref (L, LUA_REGISTRYINDEX);
 	}
 }
-#define pushtable(L,c,m,f) (_pushtable(L,c,offsetof(cur_data,m),f))
 
 
 /*
@@ -285,9 +757,13 @@ static int cur_getcoltypes (lua_State *L) {
 
 /*
 ** Push the number of rows.
+** Streaming cursors do not know it in advance.
 */
 static int cur_numrows (lua_State *L) {
-	lua_pushnumber (L, PQntuples (getcursor(L)->pg_res));
+	cur_data *cur = getcursor(L);
+	if (cur->mode != CUR_BUFFERED)
+		return luasql_faildirect (L, "number of rows unknown on streaming cursors");
+	lua_pushnumber (L, PQntuples (cur->pg_res));
 	return 1;
 }
 
@@ -295,12 +771,18 @@ static int cur_numrows (lua_State *L) {
 /*
 ** Create a new Cursor object and push it on top of the stack.
 */
-static int create_cursor (lua_State *L, int conn, PGresult *result) {
+static int create_cursor (lua_State *L, int conn, conn_data *cdata,
+		PGresult *result, int mode) {
 	cur_data *cur = (cur_data *)lua_newuserdata(L, sizeof(cur_data));
 	luasql_setmeta (L, LUASQL_CURSOR_PG);
 
 	/* fill in structure */
 	cur->closed = 0;
+	cur->mode = (short)mode;
+	cur->conn_data = cdata;
+	cur->batch = 0;
+	cur->in_txn = 0;
+	cur->name[0] = '\0';
 	cur->conn = LUA_NOREF;
 	cur->numcols = PQnfields(result);
 	cur->colnames = LUA_NOREF;
@@ -329,6 +811,61 @@ static void sql_rollback(conn_data *conn) {
 }
 
 
+/*
+** Send the BEGIN owed by a connection in manual commit mode.
+** conn:execute folds it into the statement instead; other ways of
+** running statements call this first.
+*/
+static void sql_ensuretxn(conn_data *conn) {
+	if (conn->pending_begin) {
+		conn->pending_begin = 0;
+		sql_begin(conn);
+	}
+}
+
+
+/*
+** Objects that need a transaction in autocommit mode, as large objects,
+** begin one when the connection is idle and share it while it is open;
+** the last of them to finish ends it. A transaction begun by the user
+** is left alone.
+** Return 1 if the object took a share, to be given back with
+** txn_release.
+*/
+static int txn_acquire (conn_data *conn) {
+	if (!conn->auto_commit) {
+		sql_ensuretxn (conn);
+		return 0;
+	}
+	if (PQtransactionStatus (conn->pg_conn) == PQTRANS_IDLE)
+		sql_begin (conn);
+	else if (conn->txn_users == 0)
+		return 0;
+	conn->txn_users++;
+	return 1;
+}
+
+
+/*
+** Give back a share of the autocommit transaction, committing or
+** rolling it back when it was the last one.
+** Return 0 if a commit was asked for but the transaction failed, and
+** so is, or will be, rolled back.
+*/
+static int txn_release (conn_data *conn, int commit) {
+	PGresult *res;
+	int ok;
+	if (--conn->txn_users > 0)
+		return !commit || PQtransactionStatus (conn->pg_conn) != PQTRANS_INERROR;
+	res = PQexec (conn->pg_conn, commit ? "COMMIT" : "ROLLBACK");
+	/* the COMMIT of a failed transaction reports a ROLLBACK */
+	ok = PQresultStatus (res) == PGRES_COMMAND_OK
+		&& (!commit || strcmp (PQcmdStatus (res), "COMMIT") == 0);
+	PQclear (res);
+	return ok;
+}
+
+
 /*
 ** Connection object collector function
 */
@@ -338,6 +875,9 @@ static int conn_gc (lua_State *L) {
 		/* Nullify structure fields. */
 		conn->closed = 1;
 		luaL_unref (L, LUA_REGISTRYINDEX, conn->env);
+		luaL_unref (L, LUA_REGISTRYINDEX, conn->typecache);
+		free (conn->copybuf);
+		conn->copybuf = NULL;
 		PQfinish (conn->pg_conn);
 	}
 	return 0;
@@ -383,14 +923,11 @@ static int conn_escape (lua_State *L) {
 
 
 /*
-** Execute an SQL statement.
-** Return a Cursor object if the statement is a query, otherwise
-** return the number of tuples affected by the statement.
+** Push the outcome of a statement: a Cursor object for queries,
+** the number of tuples affected for other statements, or nil and
+** the error message. The result is owned by the cursor or cleared.
 */
-static int conn_execute (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	const char *statement = luaL_checkstring (L, 2);
-	PGresult *res = PQexec(conn->pg_conn, statement);
+static int push_result (lua_State *L, int o, conn_data *conn, PGresult *res) {
 	if (res && PQresultStatus(res)==PGRES_COMMAND_OK) {
 		/* no tuples returned */
 		lua_pushnumber(L, atof(PQcmdTuples(res)));
@@ -399,76 +936,1316 @@ static int conn_execute (lua_State *L) {
 	}
 	else if (res && PQresultStatus(res)==PGRES_TUPLES_OK)
 		/* tuples returned */
-		return create_cursor (L, 1, res);
+		return create_cursor (L, o, conn, res, CUR_BUFFERED);
 	else {
 		/* error */
+		const char *msg = res ? PQresultErrorMessage(res) : PQerrorMessage(conn->pg_conn);
+		luasql_failmsg(L, "error executing statement. PostgreSQL: ", msg);
 		PQclear (res);
-		return luasql_failmsg(L, "error executing statement. PostgreSQL: ", PQerrorMessage(conn->pg_conn));
+		return 2;
 	}
 }
 
 
 /*
-** Commit the current transaction.
+** Execute an SQL statement.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
 */
-static int conn_commit (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	sql_commit(conn);
-	if (conn->auto_commit == 0) {
-		sql_begin(conn); 
-		lua_pushboolean (L, 1);
-	} else
-		lua_pushboolean (L, 0);
-	return 1;
+static int conn_execute (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	PGresult *res;
+	if (conn->pending_begin && !conn->binary) {
+		/* send the BEGIN in the same round trip as the statement */
+		lua_pushliteral (L, "BEGIN;");
+		lua_pushvalue (L, 2);
+		lua_concat (L, 2);
+		res = PQexec (conn->pg_conn, lua_tostring (L, -1));
+		lua_pop (L, 1);
+		if (PQtransactionStatus (conn->pg_conn) != PQTRANS_IDLE)
+			conn->pending_begin = 0;
+	}
+	else {
+		sql_ensuretxn (conn);
+		res = exec_sql (conn, statement);
+	}
+	return push_result (L, 1, conn, res);
 }
 
 
 /*
-** Rollback the current transaction.
+** Execute a query whose rows are read from the server as they are
+** fetched, instead of being stored in client memory first.
+** With libpq 17 or later, rows arrive in chunks of up to chunk_size
+** rows; otherwise one at a time.
+** Return a Cursor object, or the number of tuples affected if the
+** statement is not a query.
 */
-static int conn_rollback (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	sql_rollback(conn);
-	if (conn->auto_commit == 0) {
-		sql_begin(conn); 
-		lua_pushboolean (L, 1);
-	} else
-		lua_pushboolean (L, 0);
-	return 1;
+static int conn_stream (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	int chunk = (int)luaL_optinteger (L, 3, 1);
+	int in_txn;
+	PGresult *res;
+
+	luaL_argcheck (L, chunk > 0, 3, LUASQL_PREFIX"invalid chunk size");
+	sql_ensuretxn (conn);
+	/* the status reads as active until the query has finished */
+	in_txn = PQtransactionStatus (conn->pg_conn) != PQTRANS_IDLE;
+	if (!PQsendQueryParams (conn->pg_conn, statement, 0, NULL, NULL, NULL, NULL, conn->binary))
+		return luasql_failmsg(L, "error executing statement. PostgreSQL: ", PQerrorMessage(conn->pg_conn));
+#ifdef LIBPQ_HAS_CHUNK_MODE
+	if (chunk > 1)
+		PQsetChunkedRowsMode (conn->pg_conn, chunk);
+	else
+#endif
+	PQsetSingleRowMode (conn->pg_conn);
+
+	res = PQgetResult (conn->pg_conn);
+	switch (res ? PQresultStatus (res) : PGRES_FATAL_ERROR) {
+		case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+		case PGRES_TUPLES_CHUNK:
+#endif
+		case PGRES_TUPLES_OK:
+			create_cursor (L, 1, conn, res, CUR_STREAMING);
+			((cur_data *)lua_touserdata (L, -1))->in_txn = (short)in_txn;
+			return 1;
+		default:
+			drain_results (conn->pg_conn);
+			return push_result (L, 1, conn, res);
+	}
 }
 
 
 /*
-** Set "auto commit" property of the connection.
-** If 'true', then rollback current transaction.
-** If 'false', then start a new transaction.
+** Declare a server-side cursor for a query and return a Cursor object
+** which reads its rows with FETCH, batch_size rows at a time.
+** Outside a transaction the cursor is declared WITH HOLD, so it
+** outlives the implicit transaction of DECLARE and every other
+** statement is still committed on its own; inside one it lives until
+** its end.
 */
-static int conn_setautocommit (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	if (lua_toboolean (L, 2)) {
-		conn->auto_commit = 1;
-		sql_rollback(conn); /* Undo active transaction. */
-	}
-	else {
-		conn->auto_commit = 0;
-		sql_begin(conn);
+static int conn_declare (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	int batch = (int)luaL_optinteger (L, 3, 100);
+	int hold;
+	char name[CUR_NAME_SIZE];
+	char fetch[CUR_NAME_SIZE + 40];
+	PGresult *res;
+	cur_data *cur;
+
+	luaL_checkstring (L, 2);
+	luaL_argcheck (L, batch > 0, 3, LUASQL_PREFIX"invalid batch size");
+	sql_ensuretxn (conn);
+	hold = PQtransactionStatus (conn->pg_conn) == PQTRANS_IDLE;
+	sprintf (name, "luasql_cursor_%d", ++conn->cur_counter);
+	lua_pushfstring (L, "DECLARE %s NO SCROLL CURSOR %sFOR ", name,
+		hold ? "WITH HOLD " : "");
+	lua_pushvalue (L, 2);
+	lua_concat (L, 2);
+	res = PQexec (conn->pg_conn, lua_tostring (L, -1));
+	lua_pop (L, 1);
+	if (!res || PQresultStatus (res) != PGRES_COMMAND_OK)
+		return push_result (L, 1, conn, res);
+	PQclear (res);
+	sprintf (fetch, "FETCH FORWARD %d FROM %s", batch, name);
+	res = exec_sql (conn, fetch);
+	if (!res || PQresultStatus (res) != PGRES_TUPLES_OK) {
+		if (hold) {  /* a held cursor survives the failure */
+			sprintf (fetch, "CLOSE %s", name);
+			PQclear (PQexec (conn->pg_conn, fetch));
+		}
+		return push_result (L, 1, conn, res);
 	}
-	lua_pushboolean(L, 1);
+	create_cursor (L, 1, conn, res, CUR_DECLARED);
+	cur = (cur_data *)lua_touserdata (L, -1);
+	cur->batch = batch;
+	strcpy (cur->name, name);
 	return 1;
 }
 
 
 /*
-** Create a new Connection object and push it on top of the stack.
+** Convert the Lua values at stack positions first .. first+n-1 to
+** text parameters: nil is NULL, booleans are "t" and "f" and numbers
+** are converted in place, so the strings stay valid on the stack.
 */
-static int create_connection (lua_State *L, int env, PGconn *const pg_conn) {
-	conn_data *conn = (conn_data *)lua_newuserdata(L, sizeof(conn_data));
-	luasql_setmeta (L, LUASQL_CONNECTION_PG);
-
+static void bind_params (lua_State *L, int first, int n, const char **values) {
+	int i;
+	for (i = 0; i < n; i++) {
+		int arg = first + i;
+		switch (lua_type (L, arg)) {
+			case LUA_TNIL:
+				values[i] = NULL;
+				break;
+			case LUA_TBOOLEAN:
+				values[i] = lua_toboolean (L, arg) ? "t" : "f";
+				break;
+			case LUA_TNUMBER:
+			case LUA_TSTRING:
+				values[i] = lua_tostring (L, arg);
+				break;
+			default:
+				luaL_argerror (L, arg, LUASQL_PREFIX"invalid parameter type");
+		}
+	}
+}
+
+
+/*
+** Check for valid statement.
+*/
+static stmt_data *getstatement (lua_State *L) {
+	stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_PG);
+	luaL_argcheck (L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+	luaL_argcheck (L, !stmt->closed, 1, LUASQL_PREFIX"statement is closed");
+	return stmt;
+}
+
+
+/*
+** Statement object collector function.
+** Deallocates the statement on the server if the connection is open.
+*/
+static int stmt_gc (lua_State *L) {
+	stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_PG);
+	if (stmt != NULL && !(stmt->closed)) {
+		stmt->closed = 1;
+		if (!stmt->conn_data->closed) {
+			PGconn *pg_conn = stmt->conn_data->pg_conn;
+			char *ident = PQescapeIdentifier (pg_conn, stmt->name, strlen (stmt->name));
+			if (ident != NULL) {
+				lua_pushfstring (L, "DEALLOCATE %s", ident);
+				PQfreemem (ident);
+				PQclear (PQexec (pg_conn, lua_tostring (L, -1)));
+				lua_pop (L, 1);
+			}
+		}
+		free (stmt->values);
+		stmt->values = NULL;
+		luaL_unref (L, LUA_REGISTRYINDEX, stmt->conn);
+	}
+	return 0;
+}
+
+
+/*
+** Close the statement on top of the stack.
+** Return true in case of success, or false in case the statement was
+** already closed.
+*/
+static int stmt_close (lua_State *L) {
+	stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_PG);
+	luaL_argcheck (L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+	if (stmt->closed) {
+		lua_pushboolean (L, 0);
+		return 1;
+	}
+	stmt_gc (L);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Execute the prepared statement with the given parameters.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int stmt_execute (lua_State *L) {
+	stmt_data *stmt = getstatement (L);
+	conn_data *conn = stmt->conn_data;
+	luaL_argcheck (L, !conn->closed, 1, LUASQL_PREFIX"connection is closed");
+	luaL_argcheck (L, !conn->auto_commit || conn->txn_users == 0, 1, TXN_HELD_MSG);
+	if (lua_gettop (L) - 1 != stmt->nparams)
+		return luaL_error (L, LUASQL_PREFIX"statement expects %d parameters, got %d",
+			stmt->nparams, lua_gettop (L) - 1);
+	bind_params (L, 2, stmt->nparams, stmt->values);
+	sql_ensuretxn (conn);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, stmt->conn);
+	return push_result (L, lua_gettop (L), conn,
+		PQexecPrepared (conn->pg_conn, stmt->name, stmt->nparams,
+			stmt->values, NULL, NULL, conn->binary));
+}
+
+
+/*
+** Prepare an SQL statement under the given name, or under a generated
+** one if the name is nil.
+** Return a Statement object.
+*/
+static int conn_prepare (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *name = luaL_optstring (L, 2, NULL);
+	const char *statement = luaL_checkstring (L, 3);
+	char autoname[STMT_NAME_SIZE];
+	stmt_data *stmt;
+	PGresult *res;
+	int nparams;
+
+	if (name == NULL) {
+		sprintf (autoname, "luasql_statement_%d", ++conn->stmt_counter);
+		name = autoname;
+	}
+	luaL_argcheck (L, strlen (name) < STMT_NAME_SIZE, 2,
+		LUASQL_PREFIX"statement name too long");
+	res = PQprepare (conn->pg_conn, name, statement, 0, NULL);
+	if (!res || PQresultStatus (res) != PGRES_COMMAND_OK) {
+		const char *msg = res ? PQresultErrorMessage (res) : PQerrorMessage (conn->pg_conn);
+		luasql_failmsg (L, "error preparing statement. PostgreSQL: ", msg);
+		PQclear (res);
+		return 2;
+	}
+	PQclear (res);
+	res = PQdescribePrepared (conn->pg_conn, name);
+	if (!res || PQresultStatus (res) != PGRES_COMMAND_OK) {
+		PQclear (res);
+		return luasql_failmsg (L, "error preparing statement. PostgreSQL: ", PQerrorMessage (conn->pg_conn));
+	}
+	nparams = PQnparams (res);
+	PQclear (res);
+
+	stmt = (stmt_data *)lua_newuserdata (L, sizeof (stmt_data));
+	luasql_setmeta (L, LUASQL_STATEMENT_PG);
+	stmt->closed = 0;
+	stmt->conn = LUA_NOREF;
+	stmt->nparams = nparams;
+	stmt->conn_data = conn;
+	strcpy (stmt->name, name);
+	stmt->values = (const char **)malloc ((nparams > 0 ? nparams : 1) * sizeof (const char *));
+	if (stmt->values == NULL)  /* the collector deallocates it */
+		return luaL_error (L, LUASQL_PREFIX"out of memory");
+	lua_pushvalue (L, 1);
+	stmt->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+
+/* formats of the rows given to copyin and copyout */
+static const char *const copy_formats[] = {"text", "csv", NULL};
+
+
+/*
+** Ensure the copy buffer of the connection holds at least size bytes.
+** Return NULL if there is not enough memory.
+*/
+static char *copybuf_reserve (conn_data *conn, size_t size) {
+	if (size > conn->copybuf_size) {
+		char *buf = (char *)realloc (conn->copybuf, size);
+		if (buf == NULL)
+			return NULL;
+		conn->copybuf = buf;
+		conn->copybuf_size = size;
+	}
+	return conn->copybuf;
+}
+
+
+/*
+** Write a value escaped for the text format of COPY at buf+pos.
+** Return the new position; at most 2*len bytes are written.
+*/
+static size_t encode_text (char *buf, size_t pos, const char *s, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		switch (s[i]) {
+			case '\\': buf[pos++] = '\\'; buf[pos++] = '\\'; break;
+			case '\n': buf[pos++] = '\\'; buf[pos++] = 'n'; break;
+			case '\r': buf[pos++] = '\\'; buf[pos++] = 'r'; break;
+			case '\t': buf[pos++] = '\\'; buf[pos++] = 't'; break;
+			default: buf[pos++] = s[i];
+		}
+	}
+	return pos;
+}
+
+
+/*
+** Write a value quoted for the CSV format of COPY at buf+pos, if needed.
+** Empty strings are always quoted to tell them from NULL.
+** Return the new position; at most 2*len+2 bytes are written.
+*/
+static size_t encode_csv (char *buf, size_t pos, const char *s, size_t len) {
+	size_t i;
+	int quote = (len == 0);
+	for (i = 0; i < len && !quote; i++)
+		quote = (strchr (",\"\n\r\\", s[i]) != NULL && s[i] != '\0');
+	if (!quote) {
+		memcpy (buf + pos, s, len);
+		return pos + len;
+	}
+	buf[pos++] = '"';
+	for (i = 0; i < len; i++) {
+		if (s[i] == '"')
+			buf[pos++] = '"';
+		buf[pos++] = s[i];
+	}
+	buf[pos++] = '"';
+	return pos;
+}
+
+
+/*
+** Encode the row table on top of the stack as a line of COPY data in
+** the copy buffer. The number of fields is the "n" field of the table,
+** if present, or its length; nil fields are NULL.
+** Return an error message, or NULL and the line length in *len.
+*/
+static const char *encode_row (lua_State *L, conn_data *conn, int csv, size_t *len) {
+	int row = lua_gettop (L);
+	int i, n;
+	size_t pos = 0;
+	char *buf;
+
+	lua_getfield (L, row, "n");
+	n = lua_isnumber (L, -1) ? (int)lua_tonumber (L, -1) : (int)lua_objlen (L, row);
+	lua_pop (L, 1);
+	for (i = 1; i <= n; i++) {
+		const char *s = NULL;
+		size_t l = 0;
+		lua_rawgeti (L, row, i);
+		switch (lua_type (L, -1)) {
+			case LUA_TNIL:
+				break;
+			case LUA_TBOOLEAN:
+				s = lua_toboolean (L, -1) ? "t" : "f";
+				l = 1;
+				break;
+			case LUA_TNUMBER:
+			case LUA_TSTRING:
+				s = lua_tolstring (L, -1, &l);
+				break;
+			default:
+				lua_pop (L, 1);
+				return "invalid value in row";
+		}
+		buf = copybuf_reserve (conn, pos + 2*l + 4);
+		if (buf == NULL) {
+			lua_pop (L, 1);
+			return "not enough memory";
+		}
+		if (i > 1)
+			buf[pos++] = csv ? ',' : '\t';
+		if (s == NULL) {
+			if (!csv) {
+				buf[pos++] = '\\';
+				buf[pos++] = 'N';
+			}
+		}
+		else if (csv)
+			pos = encode_csv (buf, pos, s, l);
+		else
+			pos = encode_text (buf, pos, s, l);
+		lua_pop (L, 1);
+	}
+	buf = copybuf_reserve (conn, pos + 1);
+	if (buf == NULL)
+		return "not enough memory";
+	buf[pos++] = '\n';
+	*len = pos;
+	return NULL;
+}
+
+
+/*
+** Decode a line of COPY data in the text format into the copy buffer.
+** The fields are pushed into the table on top of the stack.
+*/
+static void decode_text (lua_State *L, char *buf, const char *line, size_t len) {
+	size_t i = 0;
+	int field = 0;
+	while (i <= len) {
+		size_t start = i, pos = 0;
+		while (i < len && line[i] != '\t') {
+			char c = line[i++];
+			if (c == '\\' && i < len) {
+				c = line[i++];
+				switch (c) {
+					case 'b': c = '\b'; break;
+					case 'f': c = '\f'; break;
+					case 'n': c = '\n'; break;
+					case 'r': c = '\r'; break;
+					case 't': c = '\t'; break;
+					case 'v': c = '\v'; break;
+					case 'x':
+						if (i < len && isxdigit ((unsigned char)line[i])) {
+							int v = 0, k;
+							for (k = 0; k < 2 && i < len && isxdigit ((unsigned char)line[i]); k++, i++)
+								v = v * 16 + (isdigit ((unsigned char)line[i]) ?
+									line[i] - '0' : tolower ((unsigned char)line[i]) - 'a' + 10);
+							c = (char)v;
+						}
+						break;
+					default:
+						if (c >= '0' && c <= '7') {
+							int v = c - '0', k;
+							for (k = 1; k < 3 && i < len && line[i] >= '0' && line[i] <= '7'; k++, i++)
+								v = v * 8 + (line[i] - '0');
+							c = (char)v;
+						}
+				}
+			}
+			buf[pos++] = c;
+		}
+		field++;
+		if (i - start == 2 && line[start] == '\\' && line[start+1] == 'N')
+			;  /* NULL */
+		else {
+			lua_pushlstring (L, buf, pos);
+			lua_rawseti (L, -2, field);
+		}
+		i++;  /* skip the delimiter */
+	}
+}
+
+
+/*
+** Decode a line of COPY data in the CSV format into the copy buffer.
+** The fields are pushed into the table on top of the stack; unquoted
+** empty fields are NULL.
+*/
+static void decode_csv (lua_State *L, char *buf, const char *line, size_t len) {
+	size_t i = 0;
+	int field = 0;
+	while (i <= len) {
+		size_t pos = 0;
+		int quoted = 0;
+		while (i < len && line[i] != ',') {
+			if (line[i] == '"') {
+				quoted = 1;
+				for (i++; i < len; i++) {
+					if (line[i] == '"') {
+						if (i + 1 < len && line[i+1] == '"')
+							i++;
+						else
+							break;
+					}
+					buf[pos++] = line[i];
+				}
+				i++;  /* skip the closing quote */
+			}
+			else
+				buf[pos++] = line[i++];
+		}
+		field++;
+		if (pos > 0 || quoted) {
+			lua_pushlstring (L, buf, pos);
+			lua_rawseti (L, -2, field);
+		}
+		i++;  /* skip the delimiter */
+	}
+}
+
+
+/*
+** Push the fields of a line of COPY data as a table.
+** Return an error message, or NULL.
+*/
+static const char *decode_row (lua_State *L, conn_data *conn, const char *line, size_t len, int csv) {
+	char *buf;
+	if (len > 0 && line[len-1] == '\n')
+		len--;
+	if (len > 0 && line[len-1] == '\r')
+		len--;
+	buf = copybuf_reserve (conn, len + 1);
+	if (buf == NULL)
+		return "not enough memory";
+	lua_newtable (L);
+	if (csv)
+		decode_csv (L, buf, line, len);
+	else
+		decode_text (L, buf, line, len);
+	return NULL;
+}
+
+
+/*
+** Execute a COPY statement and check that it entered the given mode.
+** Return 1, or push nil and an error message and return 0.
+*/
+static int start_copy (lua_State *L, conn_data *conn, const char *statement, ExecStatusType mode) {
+	PGresult *res;
+	ExecStatusType status;
+	sql_ensuretxn (conn);
+	res = PQexec (conn->pg_conn, statement);
+	status = res ? PQresultStatus (res) : PGRES_FATAL_ERROR;
+	if (status == mode) {
+		PQclear (res);
+		return 1;
+	}
+	if (status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK)
+		luasql_faildirect (L, mode == PGRES_COPY_IN ?
+			"statement is not a COPY FROM STDIN" : "statement is not a COPY TO STDOUT");
+	else
+		luasql_failmsg (L, "error executing statement. PostgreSQL: ",
+			res ? PQresultErrorMessage (res) : PQerrorMessage (conn->pg_conn));
+	PQclear (res);
+	drain_results (conn->pg_conn);
+	return 0;
+}
+
+
+/*
+** Finish a COPY statement: push the number of rows copied, or nil and
+** the given error message or the error reported by the server.
+*/
+static int finish_copy (lua_State *L, conn_data *conn, const char *err) {
+	PGresult *res = PQgetResult (conn->pg_conn);
+	drain_results (conn->pg_conn);
+	if (err != NULL) {
+		PQclear (res);
+		return luasql_failmsg (L, "error copying data: ", err);
+	}
+	if (res && PQresultStatus (res) == PGRES_COMMAND_OK) {
+		lua_pushnumber (L, atof (PQcmdTuples (res)));
+		PQclear (res);
+		return 1;
+	}
+	luasql_failmsg (L, "error copying data. PostgreSQL: ",
+		res ? PQresultErrorMessage (res) : PQerrorMessage (conn->pg_conn));
+	PQclear (res);
+	return 2;
+}
+
+
+/*
+** Execute a COPY FROM STDIN statement, sending the data returned by
+** successive calls to source until it returns nil. Strings are sent as
+** they are; tables are encoded as rows in the given format.
+** An error in source aborts the COPY.
+** Return the number of rows copied.
+*/
+static int conn_copyin (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	int csv = luaL_checkoption (L, 4, "text", copy_formats);
+	const char *err = NULL;
+
+	luaL_checktype (L, 3, LUA_TFUNCTION);
+	lua_settop (L, 4);
+	if (!start_copy (L, conn, statement, PGRES_COPY_IN))
+		return 2;
+	while (err == NULL) {
+		const char *data = NULL;
+		size_t len = 0;
+		lua_pushvalue (L, 3);
+		if (lua_pcall (L, 0, 1, 0) != 0) {
+			err = lua_isstring (L, -1) ? lua_tostring (L, -1) : "error in source";
+			break;
+		}
+		if (lua_isnil (L, -1))
+			break;
+		if (lua_type (L, -1) == LUA_TSTRING)
+			data = lua_tolstring (L, -1, &len);
+		else if (lua_istable (L, -1)) {
+			err = encode_row (L, conn, csv, &len);
+			data = conn->copybuf;
+		}
+		else
+			err = "source must return strings or tables";
+		if (err == NULL && PQputCopyData (conn->pg_conn, data, (int)len) != 1) {
+			lua_pushstring (L, PQerrorMessage (conn->pg_conn));
+			err = lua_tostring (L, -1);
+		}
+		if (err == NULL)
+			lua_settop (L, 4);
+	}
+	PQputCopyEnd (conn->pg_conn, err);
+	return finish_copy (L, conn, err);
+}
+
+
+/*
+** Execute a COPY TO STDOUT statement, calling sink with each row.
+** Rows are decoded to tables in the given format or, if no format is
+** given, passed as the lines sent by the server.
+** If sink raises an error, the remaining data is discarded.
+** Return the number of rows copied.
+*/
+static int conn_copyout (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	int format = lua_isnoneornil (L, 4) ? -1 : luaL_checkoption (L, 4, NULL, copy_formats);
+	const char *err = NULL;
+	char *line;
+	int len;
+
+	luaL_checktype (L, 3, LUA_TFUNCTION);
+	lua_settop (L, 4);
+	if (!start_copy (L, conn, statement, PGRES_COPY_OUT))
+		return 2;
+	while ((len = PQgetCopyData (conn->pg_conn, &line, 0)) > 0) {
+		if (err == NULL) {
+			lua_pushvalue (L, 3);
+			if (format < 0)
+				lua_pushlstring (L, line, len);
+			else
+				err = decode_row (L, conn, line, len, format);
+			if (err == NULL && lua_pcall (L, 1, 0, 0) != 0)
+				err = lua_isstring (L, -1) ? lua_tostring (L, -1) : "error in sink";
+		}
+		PQfreemem (line);
+	}
+	if (len == -2 && err == NULL) {
+		lua_pushstring (L, PQerrorMessage (conn->pg_conn));
+		err = lua_tostring (L, -1);
+	}
+	return finish_copy (L, conn, err);
+}
+
+
+/* OIDs are pushed as integers where Lua has them */
+#if LUA_VERSION_NUM >= 503
+#define pushoid(L, oid) lua_pushinteger (L, (lua_Integer)(oid))
+#else
+#define pushoid(L, oid) lua_pushnumber (L, (lua_Number)(oid))
+#endif
+
+
+/*
+** Check for a valid large object.
+*/
+static lo_data *getlargeobject (lua_State *L) {
+	lo_data *lo = (lo_data *)luaL_checkudata (L, 1, LUASQL_LARGEOBJECT_PG);
+	luaL_argcheck (L, lo != NULL, 1, LUASQL_PREFIX"large object expected");
+	luaL_argcheck (L, !lo->closed, 1, LUASQL_PREFIX"large object is closed");
+	luaL_argcheck (L, !lo->conn_data->closed, 1, LUASQL_PREFIX"connection is closed");
+	return lo;
+}
+
+
+/*
+** Push nil and the last error message of the connection of the large
+** object.
+*/
+static int lob_fail (lua_State *L, lo_data *lo) {
+	return luasql_failmsg (L, "error accessing large object. PostgreSQL: ",
+		PQerrorMessage (lo->conn_data->pg_conn));
+}
+
+
+/*
+** Close the descriptor and give back the share of the transaction of
+** the large object.
+** Return 0 if its changes were rolled back.
+*/
+static int lob_release (lua_State *L, lo_data *lo) {
+	int ok = 1;
+	lo->closed = 1;
+	if (!lo->conn_data->closed) {
+		lo_close (lo->conn_data->pg_conn, lo->fd);
+		if (lo->own_txn)
+			ok = txn_release (lo->conn_data, 1);
+	}
+	luaL_unref (L, LUA_REGISTRYINDEX, lo->conn);
+	return ok;
+}
+
+
+/*
+** Large object collector function.
+*/
+static int lob_gc (lua_State *L) {
+	lo_data *lo = (lo_data *)luaL_checkudata (L, 1, LUASQL_LARGEOBJECT_PG);
+	if (lo != NULL && !(lo->closed))
+		lob_release (L, lo);
+	return 0;
+}
+
+
+/*
+** Close the large object.
+** Return true in case of success, false in case it was already
+** closed, or nil and an error message if the transaction of the
+** object failed and its changes were rolled back.
+*/
+static int lob_close (lua_State *L) {
+	lo_data *lo = (lo_data *)luaL_checkudata (L, 1, LUASQL_LARGEOBJECT_PG);
+	luaL_argcheck (L, lo != NULL, 1, LUASQL_PREFIX"large object expected");
+	if (lo->closed) {
+		lua_pushboolean (L, 0);
+		return 1;
+	}
+	if (!lob_release (L, lo))
+		return luasql_faildirect (L, "transaction failed, large object changes rolled back");
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Read up to n bytes from the current position.
+** Return a string, or nil at the end of the object.
+*/
+static int lob_read (lua_State *L) {
+	lo_data *lo = getlargeobject (L);
+	lua_Number n = luaL_optnumber (L, 2, LUAL_BUFFERSIZE);
+	size_t total = 0, size;
+	luaL_Buffer b;
+
+	luaL_argcheck (L, n >= 0, 2, LUASQL_PREFIX"invalid size");
+	size = (size_t)n;
+	luaL_buffinit (L, &b);
+	while (total < size) {
+		size_t want = size - total < LUAL_BUFFERSIZE ? size - total : LUAL_BUFFERSIZE;
+		int got = lo_read (lo->conn_data->pg_conn, lo->fd, luaL_prepbuffer (&b), want);
+		if (got < 0)
+			return lob_fail (L, lo);
+		luaL_addsize (&b, (size_t)got);
+		total += (size_t)got;
+		if ((size_t)got < want)
+			break;
+	}
+	luaL_pushresult (&b);
+	if (total == 0 && size > 0)
+		lua_pushnil (L);
+	return 1;
+}
+
+
+/*
+** Write a string at the current position.
+** Return the number of bytes written.
+*/
+static int lob_write (lua_State *L) {
+	lo_data *lo = getlargeobject (L);
+	size_t len;
+	const char *s = luaL_checklstring (L, 2, &len);
+	int written = lo_write (lo->conn_data->pg_conn, lo->fd, s, len);
+	if (written < 0)
+		return lob_fail (L, lo);
+	lua_pushinteger (L, written);
+	return 1;
+}
+
+
+/*
+** Move the current position to offset bytes from the start, the
+** current position or the end of the object, as file:seek does:
+** whence comes first and defaults to "cur", and offset to 0.
+** Return the new position.
+*/
+static int lob_seek (lua_State *L) {
+	static const char *const whences[] = {"set", "cur", "end", NULL};
+	static const int modes[] = {SEEK_SET, SEEK_CUR, SEEK_END};
+	lo_data *lo = getlargeobject (L);
+	int whence = modes[luaL_checkoption (L, 2, "cur", whences)];
+	pg_int64 offset = (pg_int64)luaL_optnumber (L, 3, 0);
+	pg_int64 pos = lo_lseek64 (lo->conn_data->pg_conn, lo->fd, offset, whence);
+	if (pos < 0)
+		return lob_fail (L, lo);
+	lua_pushnumber (L, (lua_Number)pos);
+	return 1;
+}
+
+
+/*
+** Return the current position.
+*/
+static int lob_tell (lua_State *L) {
+	lo_data *lo = getlargeobject (L);
+	pg_int64 pos = lo_tell64 (lo->conn_data->pg_conn, lo->fd);
+	if (pos < 0)
+		return lob_fail (L, lo);
+	lua_pushnumber (L, (lua_Number)pos);
+	return 1;
+}
+
+
+/*
+** Truncate or extend the object to the given length.
+*/
+static int lob_truncate (lua_State *L) {
+	lo_data *lo = getlargeobject (L);
+	lua_Number len = luaL_checknumber (L, 2);
+	luaL_argcheck (L, len >= 0, 2, LUASQL_PREFIX"invalid length");
+	if (lo_truncate64 (lo->conn_data->pg_conn, lo->fd, (pg_int64)len) < 0)
+		return lob_fail (L, lo);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Open the large object with the given OID for reading ("r"), writing
+** ("w") or both ("rw").
+** In autocommit mode the object takes a share of the transaction of
+** txn_acquire, which is committed when the last share is given back.
+** Return a Large Object object.
+*/
+static int conn_lo_open (lua_State *L) {
+	static const char *const modenames[] = {"r", "w", "rw", NULL};
+	static const int modes[] = {INV_READ, INV_WRITE, INV_READ | INV_WRITE};
+	conn_data *conn = getconnection (L);
+	Oid oid = (Oid)luaL_checknumber (L, 2);
+	int mode = modes[luaL_checkoption (L, 3, "r", modenames)];
+	int own_txn = txn_acquire (conn);
+	int fd = lo_open (conn->pg_conn, oid, mode);
+	lo_data *lo;
+
+	if (fd < 0) {
+		luasql_failmsg (L, "error opening large object. PostgreSQL: ",
+			PQerrorMessage (conn->pg_conn));
+		if (own_txn)
+			txn_release (conn, 0);
+		return 2;
+	}
+	lo = (lo_data *)lua_newuserdata (L, sizeof (lo_data));
+	luasql_setmeta (L, LUASQL_LARGEOBJECT_PG);
+	lo->closed = 0;
+	lo->fd = fd;
+	lo->own_txn = (short)own_txn;
+	lo->conn_data = conn;
+	lua_pushvalue (L, 1);
+	lo->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+
+/*
+** Create a large object, optionally with the given OID, with the data
+** returned by successive calls to source until it returns nil.
+** In autocommit mode this runs in the transaction of txn_acquire.
+** Return the OID of the new object.
+*/
+static int conn_lo_import_stream (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	Oid oid = (Oid)luaL_optnumber (L, 3, InvalidOid);
+	const char *err = NULL;
+	int own_txn, fd;
+
+	luaL_checktype (L, 2, LUA_TFUNCTION);
+	lua_settop (L, 3);
+	own_txn = txn_acquire (conn);
+	oid = lo_create (conn->pg_conn, oid);
+	fd = oid == InvalidOid ? -1 : lo_open (conn->pg_conn, oid, INV_WRITE);
+	if (fd < 0) {
+		lua_pushstring (L, PQerrorMessage (conn->pg_conn));
+		err = lua_tostring (L, -1);
+	}
+	while (err == NULL) {
+		size_t len;
+		const char *data;
+		lua_pushvalue (L, 2);
+		if (lua_pcall (L, 0, 1, 0) != 0) {
+			err = lua_isstring (L, -1) ? lua_tostring (L, -1) : "error in source";
+			break;
+		}
+		if (lua_isnil (L, -1))
+			break;
+		data = lua_tolstring (L, -1, &len);
+		if (data == NULL)
+			err = "source must return strings";
+		else if (lo_write (conn->pg_conn, fd, data, len) != (int)len) {
+			lua_pushstring (L, PQerrorMessage (conn->pg_conn));
+			err = lua_tostring (L, -1);
+		}
+		if (err == NULL)
+			lua_settop (L, 3);
+	}
+	if (fd >= 0)
+		lo_close (conn->pg_conn, fd);
+	if (err != NULL) {
+		if (oid != InvalidOid)
+			lo_unlink (conn->pg_conn, oid);
+		if (own_txn)
+			txn_release (conn, 0);
+		return luasql_failmsg (L, "error importing large object: ", err);
+	}
+	if (own_txn && !txn_release (conn, 1))
+		return luasql_faildirect (L, "error importing large object: transaction failed");
+	pushoid (L, oid);
+	return 1;
+}
+
+
+/*
+** Read the large object with the given OID, calling sink with each
+** chunk of its data.
+** In autocommit mode this runs in the transaction of txn_acquire.
+** Return the number of bytes read.
+*/
+static int conn_lo_export_stream (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	Oid oid = (Oid)luaL_checknumber (L, 2);
+	const char *err = NULL;
+	char buf[LUAL_BUFFERSIZE];
+	lua_Number total = 0;
+	int own_txn, fd, got;
+
+	luaL_checktype (L, 3, LUA_TFUNCTION);
+	lua_settop (L, 3);
+	own_txn = txn_acquire (conn);
+	fd = lo_open (conn->pg_conn, oid, INV_READ);
+	if (fd < 0) {
+		lua_pushstring (L, PQerrorMessage (conn->pg_conn));
+		err = lua_tostring (L, -1);
+	}
+	while (err == NULL && (got = lo_read (conn->pg_conn, fd, buf, sizeof (buf))) != 0) {
+		if (got < 0) {
+			lua_pushstring (L, PQerrorMessage (conn->pg_conn));
+			err = lua_tostring (L, -1);
+			break;
+		}
+		lua_pushvalue (L, 3);
+		lua_pushlstring (L, buf, (size_t)got);
+		if (lua_pcall (L, 1, 0, 0) != 0)
+			err = lua_isstring (L, -1) ? lua_tostring (L, -1) : "error in sink";
+		total += got;
+	}
+	if (fd >= 0)
+		lo_close (conn->pg_conn, fd);
+	if (own_txn && !txn_release (conn, 1) && err == NULL)
+		err = "transaction failed";
+	if (err != NULL)
+		return luasql_failmsg (L, "error exporting large object: ", err);
+	lua_pushnumber (L, total);
+	return 1;
+}
+
+
+#ifdef LIBPQ_HAS_PIPELINING
+/*
+** Check for an active pipeline.
+*/
+static pipe_data *getpipeline (lua_State *L) {
+	pipe_data *pipe = (pipe_data *)luaL_checkudata (L, 1, LUASQL_PIPELINE_PG);
+	luaL_argcheck (L, pipe != NULL, 1, LUASQL_PREFIX"pipeline expected");
+	luaL_argcheck (L, !pipe->closed, 1, LUASQL_PREFIX"pipeline is finished");
+	return pipe;
+}
+
+
+/*
+** Queue an SQL statement, with optional parameters, in the pipeline.
+** Its result is returned by conn:pipeline.
+** Return true, or nil and an error message.
+*/
+static int pipe_execute (lua_State *L) {
+	pipe_data *pipe = getpipeline (L);
+	const char *statement = luaL_checkstring (L, 2);
+	int nparams = lua_gettop (L) - 2;
+	const char **values = (const char **)lua_newuserdata (L,
+		(nparams > 0 ? nparams : 1) * sizeof (const char *));
+	bind_params (L, 3, nparams, values);
+	if (!PQsendQueryParams (pipe->conn_data->pg_conn, statement, nparams,
+			NULL, values, NULL, NULL, pipe->conn_data->binary))
+		return luasql_failmsg (L, "error executing statement. PostgreSQL: ",
+			PQerrorMessage (pipe->conn_data->pg_conn));
+	pipe->count++;
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Read the results of the statements queued in the pipeline up to the
+** synchronization point, storing them in the table at index t. The
+** first error message is stored at index e.
+** If t is 0, the results are discarded.
+*/
+static void pipe_results (lua_State *L, conn_data *conn, int count, int t, int e) {
+	PGresult *res;
+	int i;
+	for (i = 1; i <= count; i++) {
+		res = PQgetResult (conn->pg_conn);
+		switch (res ? PQresultStatus (res) : PGRES_FATAL_ERROR) {
+			case PGRES_COMMAND_OK:
+				if (t) {
+					lua_pushnumber (L, atof (PQcmdTuples (res)));
+					lua_rawseti (L, t, i);
+				}
+				PQclear (res);
+				break;
+			case PGRES_TUPLES_OK:
+				if (t) {
+					create_cursor (L, 1, conn, res, CUR_BUFFERED);
+					lua_rawseti (L, t, i);
+				}
+				else
+					PQclear (res);
+				break;
+			case PGRES_PIPELINE_ABORTED:
+				PQclear (res);
+				break;
+			default:
+				if (lua_isnil (L, e)) {
+					lua_pushstring (L, res ? PQresultErrorMessage (res) : PQerrorMessage (conn->pg_conn));
+					lua_replace (L, e);
+				}
+				PQclear (res);
+		}
+		if (res != NULL)  /* the results of each statement end with NULL */
+			drain_results (conn->pg_conn);
+	}
+	/* synchronization point */
+	while ((res = PQgetResult (conn->pg_conn)) != NULL) {
+		int sync = PQresultStatus (res) == PGRES_PIPELINE_SYNC;
+		PQclear (res);
+		if (sync)
+			break;
+	}
+}
+
+
+/*
+** Call the given function with a pipeline object, whose execute method
+** queues statements that are sent to the server without waiting for
+** the results of the previous ones.
+** Return a table with the result of each statement, in order: a Cursor
+** object or the number of tuples affected; or nil and the first error.
+*/
+static int conn_pipeline (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	pipe_data *pipe;
+	int status;
+
+	luaL_checktype (L, 2, LUA_TFUNCTION);
+	lua_settop (L, 2);
+	pipe = (pipe_data *)lua_newuserdata (L, sizeof (pipe_data));
+	luasql_setmeta (L, LUASQL_PIPELINE_PG);
+	pipe->closed = 1;
+	pipe->count = 0;
+	pipe->conn_data = conn;
+	sql_ensuretxn (conn);
+	if (!PQenterPipelineMode (conn->pg_conn))
+		return luasql_failmsg (L, "error entering pipeline mode. PostgreSQL: ",
+			PQerrorMessage (conn->pg_conn));
+	pipe->closed = 0;
+	lua_newtable (L);                    /* 4: results */
+	lua_pushnil (L);                     /* 5: first error */
+	lua_pushvalue (L, 2);
+	lua_pushvalue (L, 3);
+	status = lua_pcall (L, 1, 0, 0);     /* 6: error raised by the function */
+	pipe->closed = 1;
+	PQpipelineSync (conn->pg_conn);
+	pipe_results (L, conn, pipe->count, status == 0 ? 4 : 0, 5);
+	PQexitPipelineMode (conn->pg_conn);
+	if (status != 0)
+		return lua_error (L);
+	if (!lua_isnil (L, 5))
+		return luasql_failmsg (L, "error executing statement. PostgreSQL: ", lua_tostring (L, 5));
+	lua_pushvalue (L, 4);
+	return 1;
+}
+#endif
+
+
+/*
+** Send an SQL statement, with optional parameters, without waiting for
+** its results, which are read with conn:result.
+** Return true, or nil and an error message.
+*/
+static int conn_send (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	int nparams = lua_gettop (L) - 2;
+	int ok;
+	sql_ensuretxn (conn);
+	if (nparams == 0 && !conn->binary)
+		ok = PQsendQuery (conn->pg_conn, statement);
+	else {
+		const char **values = (const char **)lua_newuserdata (L,
+			(nparams > 0 ? nparams : 1) * sizeof (const char *));
+		bind_params (L, 3, nparams, values);
+		ok = PQsendQueryParams (conn->pg_conn, statement, nparams,
+			NULL, values, NULL, NULL, conn->binary);
+	}
+	if (!ok)
+		return luasql_failmsg (L, "error sending statement. PostgreSQL: ",
+			PQerrorMessage (conn->pg_conn));
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Return the file descriptor of the connection socket, to wait for
+** it to become readable before calling conn:consume.
+*/
+static int conn_socket (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	int fd = PQsocket (conn->pg_conn);
+	if (fd < 0)
+		return luasql_faildirect (L, "connection has no socket");
+	lua_pushinteger (L, fd);
+	return 1;
+}
+
+
+/*
+** Read the input available on the connection socket.
+** Return true, or nil and an error message.
+*/
+static int conn_consume (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	if (!PQconsumeInput (conn->pg_conn))
+		return luasql_failmsg (L, "error reading input. PostgreSQL: ",
+			PQerrorMessage (conn->pg_conn));
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Return true if conn:result would block waiting for input.
+*/
+static int conn_isbusy (lua_State *L) {
+	lua_pushboolean (L, PQisBusy (getconnection (L)->pg_conn));
+	return 1;
+}
+
+
+/*
+** Return the next result of the statements sent with conn:send:
+** a Cursor object or the number of tuples affected; nil and an error
+** message if the statement failed; or nil when there are no more
+** results.
+*/
+static int conn_result (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	PGresult *res = PQgetResult (conn->pg_conn);
+	if (res == NULL) {
+		lua_pushnil (L);
+		return 1;
+	}
+	return push_result (L, 1, conn, res);
+}
+
+
+/*
+** Read the input available on the connection and return an array with
+** the notifications received, up to max of them, as tables with the
+** fields channel, payload and pid.
+*/
+static int conn_notifications (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	int max = (int)luaL_optinteger (L, 2, 0);
+	PGnotify *notify;
+	int n = 0;
+
+	if (!PQconsumeInput (conn->pg_conn))
+		return luasql_failmsg (L, "error reading input. PostgreSQL: ",
+			PQerrorMessage (conn->pg_conn));
+	lua_newtable (L);
+	while ((max <= 0 || n < max) && (notify = PQnotifies (conn->pg_conn)) != NULL) {
+		lua_newtable (L);
+		lua_pushstring (L, notify->relname);
+		lua_setfield (L, -2, "channel");
+		lua_pushstring (L, notify->extra);
+		lua_setfield (L, -2, "payload");
+		lua_pushinteger (L, notify->be_pid);
+		lua_setfield (L, -2, "pid");
+		PQfreemem (notify);
+		lua_rawseti (L, -2, ++n);
+	}
+	return 1;
+}
+
+
+/*
+** Commit the current transaction.
+*/
+static int conn_commit (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	if (!conn->pending_begin)  /* nothing to commit otherwise */
+		sql_commit(conn);
+	if (conn->auto_commit == 0) {
+		conn->pending_begin = 1;
+		lua_pushboolean (L, 1);
+	} else
+		lua_pushboolean (L, 0);
+	return 1;
+}
+
+
+/*
+** Rollback the current transaction.
+*/
+static int conn_rollback (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	if (!conn->pending_begin)  /* nothing to undo otherwise */
+		sql_rollback(conn);
+	if (conn->auto_commit == 0) {
+		conn->pending_begin = 1;
+		lua_pushboolean (L, 1);
+	} else
+		lua_pushboolean (L, 0);
+	return 1;
+}
+
+
+/*
+** Set "auto commit" property of the connection.
+** If 'true', then rollback current transaction.
+** If 'false', then start a new transaction, whose BEGIN is only sent
+** with the next statement.
+*/
+static int conn_setautocommit (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	if (lua_toboolean (L, 2)) {
+		conn->auto_commit = 1;
+		if (!conn->pending_begin)
+			sql_rollback(conn); /* Undo active transaction. */
+		conn->pending_begin = 0;
+	}
+	else {
+		conn->auto_commit = 0;
+		if (PQtransactionStatus (conn->pg_conn) == PQTRANS_IDLE)
+			conn->pending_begin = 1;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+
+/*
+** Set the format of query results: binary if true, text otherwise.
+** In binary mode, statements given to execute may not contain more
+** than one command.
+*/
+static int conn_setbinary (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	conn->binary = lua_toboolean (L, 2);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Forget the type names cached by the connection, which are read
+** again when needed, e.g. after types were altered or recreated.
+*/
+static int conn_cleartypecache (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	luaL_unref (L, LUA_REGISTRYINDEX, conn->typecache);
+	conn->typecache = LUA_NOREF;
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Create a new Connection object and push it on top of the stack.
+*/
+static int create_connection (lua_State *L, int env, PGconn *const pg_conn) {
+	conn_data *conn = (conn_data *)lua_newuserdata(L, sizeof(conn_data));
+	luasql_setmeta (L, LUASQL_CONNECTION_PG);
+
 	/* fill in structure */
 	conn->closed = 0;
 	conn->env = LUA_NOREF;
 	conn->auto_commit = 1;
+	conn->pending_begin = 0;
+	conn->txn_users = 0;
+	conn->cur_counter = 0;
+	conn->stmt_counter = 0;
+	conn->binary = 0;
+	conn->typecache = LUA_NOREF;
+	conn->copybuf = NULL;
+	conn->copybuf_size = 0;
 	conn->pg_conn = pg_conn;
 	lua_pushvalue (L, env);
 	conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
@@ -513,6 +2290,168 @@ static int env_connect (lua_State *L) {
 }
 
 
+/*
+** Check for a valid pending connection.
+*/
+static pending_data *getpending (lua_State *L) {
+	pending_data *pend = (pending_data *)luaL_checkudata (L, 1, LUASQL_PENDING_PG);
+	luaL_argcheck (L, pend != NULL, 1, LUASQL_PREFIX"pending connection expected");
+	luaL_argcheck (L, !pend->closed, 1, LUASQL_PREFIX"pending connection is closed");
+	return pend;
+}
+
+
+/*
+** Pending connection object collector function.
+*/
+static int pend_gc (lua_State *L) {
+	pending_data *pend = (pending_data *)luaL_checkudata (L, 1, LUASQL_PENDING_PG);
+	if (pend != NULL && !(pend->closed)) {
+		pend->closed = 1;
+		luaL_unref (L, LUA_REGISTRYINDEX, pend->env);
+		PQfinish (pend->pg_conn);
+		pend->pg_conn = NULL;
+	}
+	return 0;
+}
+
+
+/*
+** Abandon the pending connection.
+** Return true in case of success, or false in case it was already
+** closed or established.
+*/
+static int pend_close (lua_State *L) {
+	pending_data *pend = (pending_data *)luaL_checkudata (L, 1, LUASQL_PENDING_PG);
+	luaL_argcheck (L, pend != NULL, 1, LUASQL_PREFIX"pending connection expected");
+	if (pend->closed) {
+		lua_pushboolean (L, 0);
+		return 1;
+	}
+	pend_gc (L);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Return the file descriptor of the socket of the pending connection.
+*/
+static int pend_socket (lua_State *L) {
+	int fd = PQsocket (getpending (L)->pg_conn);
+	if (fd < 0)
+		return luasql_faildirect (L, "connection has no socket");
+	lua_pushinteger (L, fd);
+	return 1;
+}
+
+
+/*
+** Advance the connection establishment.
+** Return "reading" or "writing", telling what the socket must be ready
+** for before the next call; or "ok" and the Connection object once it
+** is established; or nil and an error message.
+*/
+static int pend_poll (lua_State *L) {
+	pending_data *pend = getpending (L);
+	switch (PQconnectPoll (pend->pg_conn)) {
+		case PGRES_POLLING_READING:
+			lua_pushliteral (L, "reading");
+			return 1;
+		case PGRES_POLLING_WRITING:
+			lua_pushliteral (L, "writing");
+			return 1;
+		case PGRES_POLLING_OK: {
+			PGconn *pg_conn = pend->pg_conn;
+			lua_pushliteral (L, "ok");
+			lua_rawgeti (L, LUA_REGISTRYINDEX, pend->env);
+			/* the Connection object takes over the PGconn */
+			pend->closed = 1;
+			pend->pg_conn = NULL;
+			luaL_unref (L, LUA_REGISTRYINDEX, pend->env);
+			PQsetNoticeProcessor (pg_conn, notice_processor, NULL);
+			create_connection (L, lua_gettop (L), pg_conn);
+			lua_remove (L, -2);
+			return 2;
+		}
+		default:
+			return luasql_failmsg (L, "error connecting to database. PostgreSQL: ",
+				PQerrorMessage (pend->pg_conn));
+	}
+}
+
+
+/*
+** Start connecting to a data source without blocking.
+** The data source is a connection string or URI, as in env:connect, or
+** a table of connection parameters.
+** Return a pending connection object.
+*/
+static int env_connect_start (lua_State *L) {
+	const char **keywords, **values;
+	int n = 0;
+	int expand = 0;
+	PGconn *pg_conn;
+	pending_data *pend;
+
+	getenvironment (L);	/* validate environment */
+	lua_settop (L, 2);
+	if (lua_istable (L, 2)) {
+		lua_newtable (L);  /* 3: parameter strings, to keep them alive */
+		lua_pushnil (L);
+		while (lua_next (L, 2) != 0) {
+			luaL_argcheck (L, lua_type (L, -2) == LUA_TSTRING && lua_isstring (L, -1), 2,
+				LUASQL_PREFIX"invalid connection parameter");
+			lua_pushvalue (L, -2);
+			lua_rawseti (L, 3, ++n);
+			lua_pushstring (L, lua_tostring (L, -1));
+			lua_rawseti (L, 3, ++n);
+			lua_pop (L, 1);
+		}
+		n /= 2;
+	}
+	else {
+		luaL_checkstring (L, 2);
+		lua_newtable (L);
+		lua_pushliteral (L, "dbname");
+		lua_rawseti (L, 3, 1);
+		lua_pushvalue (L, 2);
+		lua_rawseti (L, 3, 2);
+		n = 1;
+		expand = 1;  /* the string may be a connection string or URI */
+	}
+	keywords = (const char **)lua_newuserdata (L, 2 * (n + 1) * sizeof (const char *));
+	values = keywords + n + 1;
+	{
+		int i;
+		for (i = 0; i < n; i++) {
+			lua_rawgeti (L, 3, 2*i + 1);
+			keywords[i] = lua_tostring (L, -1);
+			lua_rawgeti (L, 3, 2*i + 2);
+			values[i] = lua_tostring (L, -1);
+			lua_pop (L, 2);
+		}
+		keywords[n] = values[n] = NULL;
+	}
+
+	pg_conn = PQconnectStartParams (keywords, values, expand);
+	if (pg_conn == NULL)
+		return luasql_faildirect (L, "not enough memory to connect");
+	if (PQstatus (pg_conn) == CONNECTION_BAD) {
+		luasql_failmsg (L, "error connecting to database. PostgreSQL: ", PQerrorMessage (pg_conn));
+		PQfinish (pg_conn);
+		return 2;
+	}
+	pend = (pending_data *)lua_newuserdata (L, sizeof (pending_data));
+	luasql_setmeta (L, LUASQL_PENDING_PG);
+	pend->closed = 0;
+	pend->pg_conn = pg_conn;
+	lua_pushvalue (L, 1);
+	pend->env = luaL_ref (L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+
 /*
 ** Environment object collector function.
 */
@@ -552,6 +2491,24 @@ static void create_metatables (lua_State *L) {
 		{"__gc",    env_gc},
 		{"close",   env_close},
 		{"connect", env_connect},
+		{"connect_start", env_connect_start},
+		{NULL, NULL},
+	};
+	struct luaL_Reg largeobject_methods[] = {
+		{"__gc",     lob_gc},
+		{"close",    lob_close},
+		{"read",     lob_read},
+		{"write",    lob_write},
+		{"seek",     lob_seek},
+		{"tell",     lob_tell},
+		{"truncate", lob_truncate},
+		{NULL, NULL},
+	};
+	struct luaL_Reg pending_methods[] = {
+		{"__gc",    pend_gc},
+		{"close",   pend_close},
+		{"socket",  pend_socket},
+		{"poll",    pend_poll},
 		{NULL, NULL},
 	};
 	struct luaL_Reg connection_methods[] = {
@@ -559,9 +2516,28 @@ static void create_metatables (lua_State *L) {
 		{"close",         conn_close},
 		{"escape",        conn_escape},
 		{"execute",       conn_execute},
+		{"stream",        conn_stream},
+		{"declare",       conn_declare},
+		{"prepare",       conn_prepare},
+		{"copyin",        conn_copyin},
+		{"copyout",       conn_copyout},
+		{"lo_open",       conn_lo_open},
+		{"lo_import_stream", conn_lo_import_stream},
+		{"lo_export_stream", conn_lo_export_stream},
+#ifdef LIBPQ_HAS_PIPELINING
+		{"pipeline",      conn_pipeline},
+#endif
+		{"send",          conn_send},
+		{"socket",        conn_socket},
+		{"consume",       conn_consume},
+		{"isbusy",        conn_isbusy},
+		{"result",        conn_result},
+		{"notifications", conn_notifications},
 		{"commit",        conn_commit},
 		{"rollback",      conn_rollback},
 		{"setautocommit", conn_setautocommit},
+		{"setbinary",     conn_setbinary},
+		{"cleartypecache", conn_cleartypecache},
 		{NULL, NULL},
 	};
 	struct luaL_Reg cursor_methods[] = {
@@ -570,13 +2546,33 @@ static void create_metatables (lua_State *L) {
 		{"getcolnames", cur_getcolnames},
 		{"getcoltypes", cur_getcoltypes},
 		{"fetch",       cur_fetch},
+		{"fetchmany",   cur_fetchmany},
 		{"numrows",     cur_numrows},
 		{NULL, NULL},
 	};
+	struct luaL_Reg statement_methods[] = {
+		{"__gc",        stmt_gc},
+		{"close",       stmt_close},
+		{"execute",     stmt_execute},
+		{NULL, NULL},
+	};
+#ifdef LIBPQ_HAS_PIPELINING
+	struct luaL_Reg pipeline_methods[] = {
+		{"execute",     pipe_execute},
+		{NULL, NULL},
+	};
+#endif
 	luasql_createmeta (L, LUASQL_ENVIRONMENT_PG, environment_methods);
 	luasql_createmeta (L, LUASQL_CONNECTION_PG, connection_methods);
 	luasql_createmeta (L, LUASQL_CURSOR_PG, cursor_methods);
-	lua_pop (L, 3);
+	luasql_createmeta (L, LUASQL_STATEMENT_PG, statement_methods);
+	luasql_createmeta (L, LUASQL_PENDING_PG, pending_methods);
+	luasql_createmeta (L, LUASQL_LARGEOBJECT_PG, largeobject_methods);
+	lua_pop (L, 6);
+#ifdef LIBPQ_HAS_PIPELINING
+	luasql_createmeta (L, LUASQL_PIPELINE_PG, pipeline_methods);
+	lua_pop (L, 1);
+#endif
 }
 
 /*
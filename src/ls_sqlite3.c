@@ -6,6 +6,7 @@
 ** $Id: ls_sqlite3.c,v 1.15 2009/02/07 23:16:23 tomas Exp $
 */
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,6 +23,34 @@
 #define LUASQL_ENVIRONMENT_SQLITE "SQLite3 environment"
 #define LUASQL_CONNECTION_SQLITE "SQLite3 connection"
 #define LUASQL_CURSOR_SQLITE "SQLite3 cursor"
+#define LUASQL_BLOB_SQLITE "SQLite3 blob"
+
+/* before 3.36, serialization needs a library built with it enabled */
+#if (SQLITE_VERSION_NUMBER >= 3036000 && !defined(SQLITE_OMIT_DESERIALIZE)) || \
+    defined(SQLITE_ENABLE_DESERIALIZE)
+#define LUASQL_SQLITE_SERIALIZE
+#endif
+
+#if SQLITE_VERSION_NUMBER >= 3037000
+#define sqlite_changes(db) sqlite3_changes64(db)
+#define sqlite_total_changes(db) sqlite3_total_changes64(db)
+#else
+#define sqlite_changes(db) sqlite3_changes(db)
+#define sqlite_total_changes(db) sqlite3_total_changes(db)
+#endif
+
+/* 64-bit counters and rowids are exact integers from Lua 5.3 on */
+#if LUA_VERSION_NUM >= 503
+#define push_int64(L, n) lua_pushinteger(L, (lua_Integer)(n))
+#else
+#define push_int64(L, n) lua_pushnumber(L, (lua_Number)(n))
+#endif
+
+#define STMT_STATUS_COUNT 4
+
+#if SQLITE_VERSION_NUMBER >= 3009000 && !defined(SQLITE_OMIT_VIRTUALTABLE)
+#define LUASQL_SQLITE_VTAB
+#endif
 
 typedef struct
 {
@@ -29,13 +58,57 @@ typedef struct
 } env_data;
 
 
+typedef struct
+{
+  int          timeout;            /* give up waiting after this many ms */
+  int          min_sleep;          /* first backoff delay in ms */
+  int          max_sleep;          /* largest backoff delay in ms */
+  int          wait;               /* ms waited in the current busy event */
+  unsigned long events;            /* number of busy events */
+  lua_Number   total_wait;         /* ms waited in all busy events */
+  int          max_wait;           /* longest busy event in ms */
+} busy_data;
+
+
+/*
+** Process-wide pool of connections to one database file, shared by
+** all Lua states that load the driver. Readers are opened read-only
+** without mutexes and leased to one state at a time; writes go
+** through a single serialized connection.
+*/
+typedef struct pool_data
+{
+  struct pool_data *next;
+  char         *path;
+  int          size;               /* maximum number of readers */
+  int          opened;             /* number of readers opened */
+  int          idle;               /* number of readers in `readers' */
+  int          flags;              /* open flags of the readers */
+  sqlite3      **readers;          /* idle readers */
+  sqlite3      *writer;            /* writer connection, if opened */
+  short        writer_busy;        /* writer is checked out */
+  unsigned long checkouts;         /* number of successful checkouts */
+  unsigned long waits;             /* checkouts that had to wait */
+  unsigned long timeouts;          /* checkouts that gave up waiting */
+  lua_Number   total_wait;         /* ms waited in all checkouts */
+  int          max_wait;           /* longest wait in ms */
+} pool_data;
+
+
 typedef struct
 {
   short        closed;
   int          env;                /* reference to environment */
   short        auto_commit;        /* 0 for manual commit */
   unsigned int cur_counter;
+  unsigned int blob_counter;
+  short        timed_out;          /* set when the deadline interrupts */
+  sqlite3_int64 deadline;          /* in ms, 0 when there is no deadline */
+  busy_data    busy;               /* busy handler settings and counters */
+  pool_data    *pool;              /* pool owning the handle, or NULL */
+  short        pool_writer;        /* handle is the pool writer */
   sqlite3      *sql_conn;
+  lua_State    *L;                 /* state running the current call */
 } conn_data;
 
 
@@ -46,9 +119,60 @@ typedef struct
   int         numcols;            /* number of columns */
   int         colnames, coltypes; /* reference to column information tables */
   conn_data   *conn_data;         /* reference to connection for cursor */
+  int         status[STMT_STATUS_COUNT]; /* counters saved at finalization */
   sqlite3_stmt  *sql_vm;
 } cur_data;
 
+
+typedef struct
+{
+  short         closed;
+  int           conn;             /* reference to connection */
+  int           offset;           /* position of the next read/write */
+  conn_data     *conn_data;       /* reference to connection for blob */
+  sqlite3_blob  *blob;
+} blob_data;
+
+
+typedef struct
+{
+  conn_data   *conn;              /* connection owning the function */
+  int         fn;                 /* reference to scalar or step function */
+  int         final;              /* reference to final function */
+} func_data;
+
+
+#ifdef LUASQL_SQLITE_VTAB
+typedef struct
+{
+  conn_data   *conn;              /* connection owning the module */
+  int         factory;            /* reference to iterator factory */
+  int         columns;            /* reference to table of column names */
+  int         numcols;            /* visible columns, parameters follow */
+  char        *decl;              /* CREATE TABLE statement of the module */
+} module_data;
+
+
+typedef struct
+{
+  sqlite3_vtab  base;
+  module_data   *module;
+} vtab_data;
+
+
+typedef struct
+{
+  sqlite3_vtab_cursor base;
+  int           iter;             /* reference to iterator function */
+  int           row;              /* reference to current row */
+  int           args;             /* reference to table of constraints */
+  sqlite3_int64 rowid;
+} vcur_data;
+#endif
+
+
+typedef void (*creator) (lua_State *L, cur_data *cur);
+
 LUASQL_API int luaopen_luasql_sqlite3(lua_State *L);
 
 
@@ -70,6 +194,7 @@ static conn_data *getconnection(lua_State *L) {
   conn_data *conn = (conn_data *)luaL_checkudata (L, 1, LUASQL_CONNECTION_SQLITE);
   luaL_argcheck(L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
   luaL_argcheck(L, !conn->closed, 1, LUASQL_PREFIX"connection is closed");
+  conn->L = L;
   return conn;
 }
 
@@ -81,9 +206,64 @@ static cur_data *getcursor(lua_State *L) {
   cur_data *cur = (cur_data *)luaL_checkudata (L, 1, LUASQL_CURSOR_SQLITE);
   luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
   luaL_argcheck(L, !cur->closed, 1, LUASQL_PREFIX"cursor is closed");
+  cur->conn_data->L = L;
   return cur;
 }
 
+
+/*
+** Check for valid blob.
+*/
+static blob_data *getblob(lua_State *L) {
+  blob_data *blob = (blob_data *)luaL_checkudata (L, 1, LUASQL_BLOB_SQLITE);
+  luaL_argcheck(L, blob != NULL, 1, LUASQL_PREFIX"blob expected");
+  luaL_argcheck(L, !blob->closed, 1, LUASQL_PREFIX"blob is closed");
+  return blob;
+}
+
+
+/*
+** Return the boolean value of field `name' of the options table.
+*/
+static int opt_flag(lua_State *L, int opts, const char *name)
+{
+  int value;
+  lua_getfield(L, opts, name);
+  value = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return value;
+}
+
+
+/*
+** Return the integer field `name' of the options table, or def if it
+** is not set.
+*/
+static lua_Integer opt_integer(lua_State *L, int opts, const char *name,
+			       lua_Integer def)
+{
+  lua_Integer value = def;
+  lua_getfield(L, opts, name);
+  if (!lua_isnil(L, -1))
+    {
+      if (!lua_isnumber(L, -1))
+        luaL_error(L, LUASQL_PREFIX"option `%s' must be a number", name);
+      value = lua_tointeger(L, -1);
+    }
+  lua_pop(L, 1);
+  return value;
+}
+
+/*
+** Return the message of the last error of the connection.
+*/
+static const char *conn_errmsg(conn_data *conn) {
+  if (conn->timed_out)
+    return "query deadline exceeded";
+  return sqlite3_errmsg(conn->sql_conn);
+}
+
+
 /*
 ** Closes the cursor and nullify all structure fields.
 */
@@ -105,15 +285,42 @@ static void cur_nullify(lua_State *L, cur_data *cur)
 }
 
 
+/*
+** Statement counters reported by cur:status(), in the order of
+** status_names.
+*/
+static const int status_ops[STMT_STATUS_COUNT] = {
+  SQLITE_STMTSTATUS_FULLSCAN_STEP,
+  SQLITE_STMTSTATUS_SORT,
+  SQLITE_STMTSTATUS_AUTOINDEX,
+  SQLITE_STMTSTATUS_VM_STEP,
+};
+static const char *const status_names[STMT_STATUS_COUNT] = {
+  "fullscan_step", "sort", "autoindex", "vm_step",
+};
+
+
+/*
+** Keep the statement counters so that they remain available once
+** the cursor is closed.
+*/
+static void save_status(cur_data *cur) {
+  int i;
+  for (i = 0; i < STMT_STATUS_COUNT; i++)
+    cur->status[i] = sqlite3_stmt_status(cur->sql_vm, status_ops[i], 0);
+}
+
+
 /*
 ** Finalizes the vm
 ** Return nil + errmsg or nil in case of sucess
 */
 static int finalize(lua_State *L, cur_data *cur) {
   const char *errmsg;
+  save_status(cur);
   if (sqlite3_finalize(cur->sql_vm) != SQLITE_OK)
     {
-      errmsg = sqlite3_errmsg(cur->conn_data->sql_conn);
+      errmsg = conn_errmsg(cur->conn_data);
       cur_nullify(L, cur);
       return luasql_faildirect(L, errmsg);
     }
@@ -149,6 +356,57 @@ static void push_column(lua_State *L, sqlite3_stmt *vm, int column) {
 }
 
 
+/*
+** Creates the list of fields names and pushes it on top of the stack.
+*/
+static void create_colnames(lua_State *L, cur_data *cur)
+{
+  int i;
+  lua_createtable(L, cur->numcols, 0);
+  for (i = 0; i < cur->numcols;)
+    {
+      lua_pushstring(L, sqlite3_column_name(cur->sql_vm, i));
+      lua_rawseti(L, -2, ++i);
+    }
+}
+
+
+/*
+** Creates the list of fields types and pushes it on top of the stack.
+*/
+static void create_coltypes(lua_State *L, cur_data *cur)
+{
+  int i;
+  lua_createtable(L, cur->numcols, 0);
+  for (i = 0; i < cur->numcols;)
+    {
+      lua_pushstring(L, sqlite3_column_decltype(cur->sql_vm, i));
+      lua_rawseti(L, -2, ++i);
+    }
+}
+
+
+/*
+** Pushes a column information table on top of the stack.
+** If the table isn't built yet, call the creator function and stores
+** a reference to it on the cursor structure.
+*/
+static void _pushtable(lua_State *L, cur_data *cur, size_t off, creator func)
+{
+  int *ref = (int *)((char *)cur + off);
+  if (*ref != LUA_NOREF)
+    lua_rawgeti(L, LUA_REGISTRYINDEX, *ref);
+  else
+    {
+      func(L, cur);
+      /* Stores a reference to it on the cursor structure */
+      lua_pushvalue(L, -1);
+      *ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+}
+#define pushtable(L,c,m,f) (_pushtable(L,c,offsetof(cur_data,m),f))
+
+
 /*
 ** Get another row of the given cursor.
 */
@@ -160,6 +418,7 @@ static int cur_fetch (lua_State *L) {
   if (vm == NULL)
     return 0;
 
+  cur->conn_data->timed_out = 0;
   res = sqlite3_step(vm);
 
   /* no more results? */
@@ -186,7 +445,7 @@ static int cur_fetch (lua_State *L) {
       if (strchr(opts, 'a') != NULL)
         {
           /* Copy values to alphanumerical indices */
-          lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
+          pushtable(L, cur, colnames, create_colnames);
 
           for (i = 0; i < cur->numcols; i++)
             {
@@ -209,6 +468,74 @@ static int cur_fetch (lua_State *L) {
 }
 
 
+/*
+** Fetch up to n rows (all remaining rows by default) into one array
+** per column. NULL values leave holes in the arrays.
+** Return the table of column arrays and the number of rows fetched,
+** or nil when there are no more rows.
+*/
+static int cur_fetchcolumns(lua_State *L)
+{
+  cur_data *cur = getcursor(L);
+  sqlite3_stmt *vm = cur->sql_vm;
+  lua_Integer limit = luaL_optinteger(L, 2, 0);
+  int presize, base, i, rows = 0, res = SQLITE_ROW;
+
+  luaL_argcheck(L, limit >= 0, 2, LUASQL_PREFIX"invalid number of rows");
+  luaL_checkstack(L, cur->numcols + 2, LUASQL_PREFIX"too many columns");
+  /* do not trust huge limits for preallocation */
+  presize = (limit > 0 && limit < 65536) ? (int)limit : 0;
+
+  lua_createtable(L, cur->numcols, 0);
+  base = lua_gettop(L);
+  for (i = 0; i < cur->numcols; i++)
+    lua_createtable(L, presize, 0);
+
+  cur->conn_data->timed_out = 0;
+  while (limit == 0 || rows < limit)
+    {
+      res = sqlite3_step(vm);
+      if (res != SQLITE_ROW)
+        break;
+      rows++;
+      for (i = 0; i < cur->numcols; i++)
+        {
+          switch (sqlite3_column_type(vm, i))
+            {
+            case SQLITE_INTEGER:
+              lua_pushinteger(L, sqlite3_column_int64(vm, i));
+              break;
+            case SQLITE_FLOAT:
+              lua_pushnumber(L, sqlite3_column_double(vm, i));
+              break;
+            case SQLITE_NULL:
+              continue;
+            default:
+              push_column(L, vm, i);
+              break;
+            }
+          lua_rawseti(L, base + 1 + i, rows);
+        }
+    }
+
+  if (res != SQLITE_ROW)
+    {
+      if (res != SQLITE_DONE || rows == 0)
+        return finalize(L, cur);  /* error or no more rows */
+      finalize(L, cur);
+    }
+
+  for (i = 0; i < cur->numcols; i++)
+    {
+      lua_pushvalue(L, base + 1 + i);
+      lua_rawseti(L, base, i + 1);
+    }
+  lua_pushvalue(L, base);
+  lua_pushinteger(L, rows);
+  return 2;
+}
+
+
 /*
 ** Cursor object collector function
 */
@@ -236,6 +563,7 @@ static int cur_close(lua_State *L)
     lua_pushboolean(L, 0);
     return 1;
   }
+  save_status(cur);
   sqlite3_finalize(cur->sql_vm);
   cur_nullify(L, cur);
   lua_pushboolean(L, 1);
@@ -243,13 +571,40 @@ static int cur_close(lua_State *L)
 }
 
 
+/*
+** Return a table with the statement counters: fullscan_step, sort,
+** autoindex and vm_step. The counters of a closed cursor are the ones
+** at the time it was closed. If the argument is true, reset them.
+*/
+static int cur_status(lua_State *L)
+{
+  cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
+  int reset = lua_toboolean(L, 2);
+  int i;
+  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
+  lua_createtable(L, 0, STMT_STATUS_COUNT);
+  for (i = 0; i < STMT_STATUS_COUNT; i++)
+    {
+      if (cur->closed)
+        {
+          lua_pushinteger(L, cur->status[i]);
+          if (reset)
+            cur->status[i] = 0;
+        }
+      else
+        lua_pushinteger(L, sqlite3_stmt_status(cur->sql_vm, status_ops[i], reset));
+      lua_setfield(L, -2, status_names[i]);
+    }
+  return 1;
+}
+
+
 /*
 ** Return the list of field names.
 */
 static int cur_getcolnames(lua_State *L)
 {
-  cur_data *cur = getcursor(L);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
+  pushtable(L, getcursor(L), colnames, create_colnames);
   return 1;
 }
 
@@ -259,8 +614,150 @@ static int cur_getcolnames(lua_State *L)
 */
 static int cur_getcoltypes(lua_State *L)
 {
-  cur_data *cur = getcursor(L);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->coltypes);
+  pushtable(L, getcursor(L), coltypes, create_coltypes);
+  return 1;
+}
+
+
+/*
+** Closes the blob and nullify all structure fields.
+** Return the result of sqlite3_blob_close.
+*/
+static int blob_nullify(lua_State *L, blob_data *blob)
+{
+  int res = sqlite3_blob_close(blob->blob);
+
+  blob->closed = 1;
+  blob->blob = NULL;
+  blob->conn_data->blob_counter--;
+  luaL_unref(L, LUA_REGISTRYINDEX, blob->conn);
+  return res;
+}
+
+
+/*
+** Read up to n bytes, starting at the given offset or at the end of
+** the previous read/write. Without n the rest of the BLOB is read; a
+** large BLOB is read in pieces by passing n.
+** Return nil at the end of the BLOB.
+*/
+static int blob_read(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  int size = sqlite3_blob_bytes(blob->blob);
+  lua_Integer n, offset;
+  luaL_Buffer b;
+
+  offset = luaL_optinteger(L, 3, blob->offset);
+  luaL_argcheck(L, offset >= 0 && offset <= INT_MAX, 3,
+		LUASQL_PREFIX"invalid offset");
+  if (offset >= size)
+    {
+      lua_pushnil(L);
+      return 1;
+    }
+  n = luaL_optinteger(L, 2, size - offset);
+  luaL_argcheck(L, n >= 0 && n <= INT_MAX, 2, LUASQL_PREFIX"invalid size");
+  if (n > size - offset)
+    n = size - offset;
+
+  luaL_buffinit(L, &b);
+  while (n > 0)
+    {
+      int chunk = n < LUAL_BUFFERSIZE ? (int)n : LUAL_BUFFERSIZE;
+      char *p = luaL_prepbuffer(&b);
+      if (sqlite3_blob_read(blob->blob, p, chunk, (int)offset) != SQLITE_OK)
+        return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+      luaL_addsize(&b, chunk);
+      offset += chunk;
+      n -= chunk;
+    }
+  blob->offset = (int)offset;
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+/*
+** Write a string at the given offset or at the end of the previous
+** read/write. A BLOB cannot grow: writing past its end is an error.
+*/
+static int blob_write(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  lua_Integer offset = luaL_optinteger(L, 3, blob->offset);
+
+  luaL_argcheck(L, offset >= 0 && offset <= INT_MAX, 3,
+		LUASQL_PREFIX"invalid offset");
+  luaL_argcheck(L, len <= (size_t)(INT_MAX - offset), 2,
+		LUASQL_PREFIX"data too long");
+  if (sqlite3_blob_write(blob->blob, data, (int)len, (int)offset) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+  blob->offset = offset + (int)len;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return the size of the BLOB in bytes.
+*/
+static int blob_size(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  lua_pushinteger(L, sqlite3_blob_bytes(blob->blob));
+  return 1;
+}
+
+
+/*
+** Move the handle to another row of the same table and column.
+*/
+static int blob_reopen(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  sqlite3_int64 rowid = (sqlite3_int64)luaL_checkinteger(L, 2);
+
+  if (sqlite3_blob_reopen(blob->blob, rowid) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+  blob->offset = 0;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Blob object collector function
+*/
+static int blob_gc(lua_State *L)
+{
+  blob_data *blob = (blob_data *)luaL_checkudata(L, 1, LUASQL_BLOB_SQLITE);
+  if (blob != NULL && !(blob->closed))
+    blob_nullify(L, blob);
+  return 0;
+}
+
+
+/*
+** Close the blob on top of the stack.
+** Return true in case of success, or false in case the blob was
+** already closed.
+*/
+static int blob_close(lua_State *L)
+{
+  blob_data *blob = (blob_data *)luaL_checkudata(L, 1, LUASQL_BLOB_SQLITE);
+  conn_data *conn;
+  luaL_argcheck(L, blob != NULL, 1, LUASQL_PREFIX"blob expected");
+  if (blob->closed) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  conn = blob->conn_data;
+  if (blob_nullify(L, blob) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
   return 1;
 }
 
@@ -273,7 +770,6 @@ static int cur_getcoltypes(lua_State *L)
 static int create_cursor(lua_State *L, int o, conn_data *conn,
 			 sqlite3_stmt *sql_vm, int numcols)
 {
-  int i;
   cur_data *cur = (cur_data*)lua_newuserdata(L, sizeof(cur_data));
   luasql_setmeta (L, LUASQL_CURSOR_SQLITE);
 
@@ -288,29 +784,55 @@ static int create_cursor(lua_State *L, int o, conn_data *conn,
   cur->coltypes = LUA_NOREF;
   cur->sql_vm = sql_vm;
   cur->conn_data = conn;
+  memset(cur->status, 0, sizeof(cur->status));
 
   lua_pushvalue(L, o);
   cur->conn = luaL_ref(L, LUA_REGISTRYINDEX);
 
-  /* create table with column names */
-  lua_newtable(L);
-  for (i = 0; i < numcols;)
-    {
-      lua_pushstring(L, sqlite3_column_name(sql_vm, i));
-      lua_rawseti(L, -2, ++i);
-    }
-  cur->colnames = luaL_ref(L, LUA_REGISTRYINDEX);
+  /* column information tables are built on first use */
+  return 1;
+}
 
-  /* create table with column types */
-  lua_newtable(L);
-  for (i = 0; i < numcols;)
-    {
-      lua_pushstring(L, sqlite3_column_decltype(sql_vm, i));
-      lua_rawseti(L, -2, ++i);
-    }
-  cur->coltypes = luaL_ref(L, LUA_REGISTRYINDEX);
 
-  return 1;
+static pool_data *pools = NULL;
+
+
+/*
+** Lock the pool list. The mutex is NULL (a no-op) when SQLite is
+** built without thread support.
+*/
+static void pool_lock(void)
+{
+  sqlite3_mutex_enter(sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1));
+}
+
+
+static void pool_unlock(void)
+{
+  sqlite3_mutex_leave(sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1));
+}
+
+
+/*
+** Give a pooled handle back to its pool, dropping any state the
+** borrowing Lua state left on it.
+*/
+static void pool_checkin(conn_data *conn)
+{
+  sqlite3 *db = conn->sql_conn;
+  pool_data *pool = conn->pool;
+
+  if (!sqlite3_get_autocommit(db))
+    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+  sqlite3_progress_handler(db, 0, NULL, NULL);
+  sqlite3_busy_handler(db, NULL, NULL);
+
+  pool_lock();
+  if (conn->pool_writer)
+    pool->writer_busy = 0;
+  else
+    pool->readers[pool->idle++] = db;
+  pool_unlock();
 }
 
 
@@ -324,10 +846,18 @@ static int conn_gc(lua_State *L)
     {
       if (conn->cur_counter > 0)
         return luaL_error (L, LUASQL_PREFIX"there are open cursors");
+      if (conn->blob_counter > 0)
+        return luaL_error (L, LUASQL_PREFIX"there are open blobs");
 
       /* Nullify structure fields. */
       conn->closed = 1;
       luaL_unref(L, LUA_REGISTRYINDEX, conn->env);
+      if (conn->pool != NULL)
+        {
+          pool_checkin(conn);
+          return 0;
+        }
+      conn->L = L;  /* function destructors run inside sqlite3_close */
       sqlite3_close(conn->sql_conn);
     }
   return 0;
@@ -382,6 +912,7 @@ static int conn_execute(lua_State *L)
   int numcols;
   const char *tail;
 
+  conn->timed_out = 0;
   res = sqlite3_prepare(conn->sql_conn, statement, -1, &vm, &tail);
   if (res != SQLITE_OK)
     {
@@ -396,7 +927,11 @@ static int conn_execute(lua_State *L)
   /* real query? if empty, must have numcols!=0 */
   if ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols))
     {
+      int i;
       sqlite3_reset(vm);
+      /* cur:status reports the caller's fetches, not this probe */
+      for (i = 0; i < STMT_STATUS_COUNT; i++)
+        sqlite3_stmt_status(vm, status_ops[i], 1);
       return create_cursor(L, 1, conn, vm, numcols);
     }
 
@@ -404,55 +939,1070 @@ static int conn_execute(lua_State *L)
     {
       sqlite3_finalize(vm);
       /* return number of columns changed */
-      lua_pushnumber(L, sqlite3_changes(conn->sql_conn));
+      push_int64(L, sqlite_changes(conn->sql_conn));
       return 1;
     }
 
-  /* error */
-  errmsg = sqlite3_errmsg(conn->sql_conn);
+  /* error: the legacy interface only reports the real one on finalize */
   sqlite3_finalize(vm);
+  errmsg = conn_errmsg(conn);
   return luasql_faildirect(L, errmsg);
 }
 
 
 /*
-** Commit the current transaction.
+** Open a BLOB for incremental I/O.
+** Arguments: table, column, rowid [, writable [, database]].
+** Return a Blob object.
 */
-static int conn_commit(lua_State *L)
+static int conn_blobopen(lua_State *L)
 {
-  char *errmsg;
   conn_data *conn = getconnection(L);
-  int res;
-  const char *sql = "COMMIT";
+  const char *table = luaL_checkstring(L, 2);
+  const char *column = luaL_checkstring(L, 3);
+  sqlite3_int64 rowid = (sqlite3_int64)luaL_checkinteger(L, 4);
+  int writable = lua_toboolean(L, 5);
+  const char *dbname = luaL_optstring(L, 6, "main");
+  sqlite3_blob *handle;
+  blob_data *blob;
 
-  if (conn->auto_commit == 0) sql = "COMMIT;BEGIN";
+  if (sqlite3_blob_open(conn->sql_conn, dbname, table, column, rowid,
+			writable, &handle) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
 
-  res = sqlite3_exec(conn->sql_conn, sql, NULL, NULL, &errmsg);
+  blob = (blob_data *)lua_newuserdata(L, sizeof(blob_data));
+  luasql_setmeta(L, LUASQL_BLOB_SQLITE);
 
-  if (res != SQLITE_OK)
-    {
-      lua_pushnil(L);
-      lua_pushliteral(L, LUASQL_PREFIX);
-      lua_pushstring(L, errmsg);
-      sqlite3_free(errmsg);
-      lua_concat(L, 2);
-      return 2;
-    }
-  lua_pushboolean(L, 1);
+  /* fill in structure */
+  blob->closed = 0;
+  blob->offset = 0;
+  blob->conn_data = conn;
+  blob->blob = handle;
+  lua_pushvalue(L, 1);
+  blob->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  conn->blob_counter++;
   return 1;
 }
 
 
 /*
-** Rollback the current transaction.
+** Push a SQL function argument onto the Lua stack.
 */
-static int conn_rollback(lua_State *L)
-{
-  char *errmsg;
-  conn_data *conn = getconnection(L);
-  int res;
-  const char *sql = "ROLLBACK";
-
+static void push_value(lua_State *L, sqlite3_value *value) {
+  switch (sqlite3_value_type(value)) {
+  case SQLITE_INTEGER:
+    lua_pushinteger(L, sqlite3_value_int64(value));
+    break;
+  case SQLITE_FLOAT:
+    lua_pushnumber(L, sqlite3_value_double(value));
+    break;
+  case SQLITE_TEXT:
+    lua_pushlstring(L, (const char *)sqlite3_value_text(value),
+		    (size_t)sqlite3_value_bytes(value));
+    break;
+  case SQLITE_BLOB:
+    lua_pushlstring(L, sqlite3_value_blob(value),
+		    (size_t)sqlite3_value_bytes(value));
+    break;
+  default:
+    lua_pushnil(L);
+    break;
+  }
+}
+
+
+/*
+** Set the result of a SQL function from the Lua value at index idx.
+*/
+static void set_result(sqlite3_context *ctx, lua_State *L, int idx) {
+  switch (lua_type(L, idx)) {
+  case LUA_TNUMBER:
+    {
+#if LUA_VERSION_NUM >= 503
+      if (lua_isinteger(L, idx))
+        {
+          sqlite3_result_int64(ctx, (sqlite3_int64)lua_tointeger(L, idx));
+          break;
+        }
+#else
+      lua_Number n = lua_tonumber(L, idx);
+      if (n == (lua_Number)(sqlite3_int64)n)
+        {
+          sqlite3_result_int64(ctx, (sqlite3_int64)n);
+          break;
+        }
+#endif
+      sqlite3_result_double(ctx, lua_tonumber(L, idx));
+      break;
+    }
+  case LUA_TSTRING:
+    {
+      size_t len;
+      const char *s = lua_tolstring(L, idx, &len);
+      sqlite3_result_text(ctx, s, (int)len, SQLITE_TRANSIENT);
+      break;
+    }
+  case LUA_TBOOLEAN:
+    sqlite3_result_int(ctx, lua_toboolean(L, idx));
+    break;
+  case LUA_TNIL:
+  case LUA_TNONE:
+    sqlite3_result_null(ctx);
+    break;
+  default:
+    sqlite3_result_error(ctx, LUASQL_PREFIX"unsupported function result type", -1);
+    break;
+  }
+}
+
+
+/*
+** Call the Lua function on the stack below its nargs arguments and
+** report errors to SQLite.
+** Return 1 with the result on top of the stack, or 0 on error.
+*/
+static int call_function(sqlite3_context *ctx, lua_State *L, int nargs) {
+  if (lua_pcall(L, nargs, 1, 0) != 0)
+    {
+      sqlite3_result_error(ctx, lua_tostring(L, -1), -1);
+      lua_pop(L, 1);
+      return 0;
+    }
+  return 1;
+}
+
+
+/*
+** Push the function arguments, checking the stack size.
+** Return 0 if there is not enough stack space.
+*/
+static int push_args(sqlite3_context *ctx, lua_State *L, int argc,
+		     sqlite3_value **argv) {
+  int i;
+  if (!lua_checkstack(L, argc + 2))
+    {
+      sqlite3_result_error(ctx, LUASQL_PREFIX"too many arguments", -1);
+      return 0;
+    }
+  for (i = 0; i < argc; i++)
+    push_value(L, argv[i]);
+  return 1;
+}
+
+
+/*
+** Scalar function callback.
+*/
+static void func_call(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  func_data *func = (func_data *)sqlite3_user_data(ctx);
+  lua_State *L = func->conn->L;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, func->fn);
+  if (!push_args(ctx, L, argc, argv))
+    {
+      lua_pop(L, 1);
+      return;
+    }
+  if (call_function(ctx, L, argc))
+    {
+      set_result(ctx, L, -1);
+      lua_pop(L, 1);
+    }
+}
+
+
+/*
+** Aggregate step callback.
+** The accumulator returned by the step function is kept in the
+** registry; its reference lives in the aggregate context.
+*/
+static void func_step(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  func_data *func = (func_data *)sqlite3_user_data(ctx);
+  lua_State *L = func->conn->L;
+  int *acc = (int *)sqlite3_aggregate_context(ctx, sizeof(int));
+
+  if (acc == NULL)
+    {
+      sqlite3_result_error_nomem(ctx);
+      return;
+    }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, func->fn);
+  if (*acc == 0)  /* first row: no accumulator yet */
+    lua_pushnil(L);
+  else
+    lua_rawgeti(L, LUA_REGISTRYINDEX, *acc);
+  if (!push_args(ctx, L, argc, argv))
+    {
+      lua_pop(L, 2);
+      return;
+    }
+  if (call_function(ctx, L, argc + 1))
+    {
+      if (*acc != 0)
+        luaL_unref(L, LUA_REGISTRYINDEX, *acc);
+      *acc = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+}
+
+
+/*
+** Aggregate final callback.
+*/
+static void func_final(sqlite3_context *ctx)
+{
+  func_data *func = (func_data *)sqlite3_user_data(ctx);
+  lua_State *L = func->conn->L;
+  int *acc = (int *)sqlite3_aggregate_context(ctx, 0);
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, func->final);
+  if (acc == NULL || *acc == 0)
+    lua_pushnil(L);
+  else
+    {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, *acc);
+      luaL_unref(L, LUA_REGISTRYINDEX, *acc);
+    }
+  if (call_function(ctx, L, 1))
+    {
+      set_result(ctx, L, -1);
+      lua_pop(L, 1);
+    }
+}
+
+
+/*
+** Release a function registration.
+** Called by SQLite when the function is redefined or the connection
+** is closed.
+*/
+static void func_destroy(void *p)
+{
+  func_data *func = (func_data *)p;
+  lua_State *L = func->conn->L;
+  luaL_unref(L, LUA_REGISTRYINDEX, func->fn);
+  luaL_unref(L, LUA_REGISTRYINDEX, func->final);
+  free(func);
+}
+
+
+/*
+** Read the function flags: true means deterministic; a table may set
+** the fields deterministic, directonly and innocuous.
+*/
+static int func_flags(lua_State *L, int idx)
+{
+  int flags = 0;
+  if (lua_isboolean(L, idx))
+    {
+#ifdef SQLITE_DETERMINISTIC
+      if (lua_toboolean(L, idx))
+        flags |= SQLITE_DETERMINISTIC;
+#endif
+    }
+  else if (lua_istable(L, idx))
+    {
+#ifdef SQLITE_DETERMINISTIC
+      if (opt_flag(L, idx, "deterministic"))
+        flags |= SQLITE_DETERMINISTIC;
+#endif
+#ifdef SQLITE_DIRECTONLY
+      if (opt_flag(L, idx, "directonly"))
+        flags |= SQLITE_DIRECTONLY;
+#endif
+#ifdef SQLITE_INNOCUOUS
+      if (opt_flag(L, idx, "innocuous"))
+        flags |= SQLITE_INNOCUOUS;
+#endif
+    }
+  return flags;
+}
+
+
+/*
+** Register a SQL function; final is 0 for scalar functions.
+*/
+static int create_function(lua_State *L, conn_data *conn, int step, int final,
+			   int flags)
+{
+  const char *name = luaL_checkstring(L, 2);
+  int nargs = (int)luaL_checkinteger(L, 3);
+  func_data *func;
+  int res;
+
+  /* callbacks would outlive the Lua state borrowing the handle */
+  if (conn->pool != NULL)
+    return luasql_faildirect(L, "not allowed on a pooled connection");
+  func = (func_data *)malloc(sizeof(func_data));
+  if (func == NULL)
+    return luaL_error(L, LUASQL_PREFIX"out of memory");
+  func->conn = conn;
+  lua_pushvalue(L, step);
+  func->fn = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (final)
+    {
+      lua_pushvalue(L, final);
+      func->final = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+  else
+    func->final = LUA_NOREF;
+
+  /* on failure SQLite calls func_destroy itself */
+  res = sqlite3_create_function_v2(conn->sql_conn, name, nargs,
+				   SQLITE_UTF8 | flags, func,
+				   final ? NULL : func_call,
+				   final ? func_step : NULL,
+				   final ? func_final : NULL,
+				   func_destroy);
+  if (res != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Register a Lua function as a scalar SQL function.
+** Arguments: name, nargs, function [, flags].
+*/
+static int conn_createfunction(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  luaL_checktype(L, 4, LUA_TFUNCTION);
+  return create_function(L, conn, 4, 0, func_flags(L, 5));
+}
+
+
+/*
+** Register a pair of Lua functions as an aggregate SQL function.
+** step(acc, ...) returns the new accumulator, which starts as nil;
+** final(acc) returns the result.
+** Arguments: name, nargs, step, final [, flags].
+*/
+static int conn_createaggregate(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  luaL_checktype(L, 4, LUA_TFUNCTION);
+  luaL_checktype(L, 5, LUA_TFUNCTION);
+  return create_function(L, conn, 4, 5, func_flags(L, 6));
+}
+
+
+/*
+** Copy the database into another connection or into a file with the
+** online backup API, pages_per_step pages at a time, so that writers
+** are only blocked during each step.
+** Arguments: destination [, pages_per_step [, sleep_ms [, progress]]].
+** progress(remaining, total) is called after each step; returning
+** false from it aborts the backup.
+*/
+static int conn_backup(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int pages = (int)luaL_optinteger(L, 3, 100);
+  int sleep_ms = (int)luaL_optinteger(L, 4, 0);
+  int progress = !lua_isnoneornil(L, 5);
+  int own_dest = 0;
+  sqlite3 *dest;
+  sqlite3_backup *backup;
+  int res;
+
+  if (progress)
+    luaL_checktype(L, 5, LUA_TFUNCTION);
+  if (lua_type(L, 2) == LUA_TSTRING)
+    {
+      if (sqlite3_open(lua_tostring(L, 2), &dest) != SQLITE_OK)
+        {
+          luasql_faildirect(L, sqlite3_errmsg(dest));
+          sqlite3_close(dest);
+          return 2;
+        }
+      own_dest = 1;
+    }
+  else
+    {
+      conn_data *dest_conn = (conn_data *)luaL_checkudata(L, 2, LUASQL_CONNECTION_SQLITE);
+      luaL_argcheck(L, !dest_conn->closed, 2, LUASQL_PREFIX"connection is closed");
+      luaL_argcheck(L, dest_conn != conn, 2, LUASQL_PREFIX"cannot backup to itself");
+      dest = dest_conn->sql_conn;
+    }
+
+  backup = sqlite3_backup_init(dest, "main", conn->sql_conn, "main");
+  if (backup == NULL)
+    {
+      luasql_faildirect(L, sqlite3_errmsg(dest));
+      if (own_dest)
+        sqlite3_close(dest);
+      return 2;
+    }
+
+  do
+    {
+      res = sqlite3_backup_step(backup, pages);
+      if (progress)
+        {
+          lua_pushvalue(L, 5);
+          lua_pushinteger(L, sqlite3_backup_remaining(backup));
+          lua_pushinteger(L, sqlite3_backup_pagecount(backup));
+          if (lua_pcall(L, 2, 1, 0) != 0 ||
+              (lua_isboolean(L, -1) && !lua_toboolean(L, -1)))
+            {
+              /* error message or false is on top of the stack */
+              sqlite3_backup_finish(backup);
+              if (own_dest)
+                sqlite3_close(dest);
+              if (lua_isboolean(L, -1))
+                return luasql_faildirect(L, "backup aborted");
+              return luasql_faildirect(L, lua_tostring(L, -1));
+            }
+          lua_pop(L, 1);
+        }
+      if (res == SQLITE_BUSY || res == SQLITE_LOCKED)
+        sqlite3_sleep(sleep_ms > 0 ? sleep_ms : 1);
+      else if (res == SQLITE_OK && sleep_ms > 0)
+        sqlite3_sleep(sleep_ms);
+    }
+  while (res == SQLITE_OK || res == SQLITE_BUSY || res == SQLITE_LOCKED);
+
+  res = sqlite3_backup_finish(backup);
+  if (res != SQLITE_OK)
+    {
+      luasql_faildirect(L, sqlite3_errmsg(dest));
+      if (own_dest)
+        sqlite3_close(dest);
+      return 2;
+    }
+  if (own_dest)
+    sqlite3_close(dest);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+#ifdef LUASQL_SQLITE_SERIALIZE
+/*
+** Return the image of a database (default "main") as a string.
+*/
+static int conn_serialize(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *schema = luaL_optstring(L, 2, "main");
+  sqlite3_int64 size = -1;
+  unsigned char *data = sqlite3_serialize(conn->sql_conn, schema, &size, 0);
+
+  if (data == NULL)
+    {
+      if (size == 0)  /* empty database */
+        {
+          lua_pushliteral(L, "");
+          return 1;
+        }
+      return luasql_faildirect(L, "cannot serialize database");
+    }
+  lua_pushlstring(L, (const char *)data, (size_t)size);
+  sqlite3_free(data);
+  return 1;
+}
+#endif
+
+
+/*
+** Return the current time in milliseconds, as given by the default VFS.
+*/
+static sqlite3_int64 current_time(void)
+{
+  sqlite3_vfs *vfs = sqlite3_vfs_find(NULL);
+  sqlite3_int64 now = 0;
+  if (vfs->iVersion >= 2 && vfs->xCurrentTimeInt64 != NULL)
+    vfs->xCurrentTimeInt64(vfs, &now);
+  else
+    {
+      double days;
+      vfs->xCurrentTime(vfs, &days);
+      now = (sqlite3_int64)(days * 86400000.0);
+    }
+  return now;
+}
+
+
+/*
+** Progress handler: interrupt the statement once the deadline passed.
+** The deadline is then disarmed, so that later statements, such as a
+** rollback, can still run.
+*/
+static int deadline_handler(void *p)
+{
+  conn_data *conn = (conn_data *)p;
+  if (conn->deadline != 0 && current_time() >= conn->deadline)
+    {
+      conn->deadline = 0;
+      conn->timed_out = 1;
+      return 1;
+    }
+  return 0;
+}
+
+
+/*
+** Set a deadline, ms milliseconds from now, after which the running
+** statement is interrupted with a "query deadline exceeded" error.
+** The clock is checked every `ops' virtual machine instructions
+** (default 1000). A nil deadline removes it.
+*/
+static int conn_setdeadline(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  if (lua_isnoneornil(L, 2))
+    {
+      conn->deadline = 0;
+      sqlite3_progress_handler(conn->sql_conn, 0, NULL, NULL);
+    }
+  else
+    {
+      lua_Number ms = luaL_checknumber(L, 2);
+      int ops = (int)luaL_optinteger(L, 3, 1000);
+      luaL_argcheck(L, ops > 0, 3, LUASQL_PREFIX"invalid number of operations");
+      conn->deadline = current_time() + (sqlite3_int64)ms;
+      sqlite3_progress_handler(conn->sql_conn, ops, deadline_handler, conn);
+    }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Interrupt the statements running on the connection.
+*/
+static int conn_interrupt(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  sqlite3_interrupt(conn->sql_conn);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Busy handler: sleep with exponential backoff and jitter until the
+** lock is released or the timeout is reached, keeping counters of
+** the time spent waiting.
+*/
+static int busy_handler(void *p, int count)
+{
+  busy_data *busy = &((conn_data *)p)->busy;
+  unsigned int jitter;
+  int delay = busy->min_sleep;
+
+  if (count == 0)  /* a new busy event */
+    {
+      busy->events++;
+      busy->wait = 0;
+    }
+  if (busy->wait >= busy->timeout)
+    return 0;
+
+  while (count-- > 0 && delay < busy->max_sleep)
+    delay *= 2;
+  if (delay > busy->max_sleep)
+    delay = busy->max_sleep;
+  /* sleep a random time between delay/2 and delay */
+  sqlite3_randomness(sizeof(jitter), &jitter);
+  delay = delay / 2 + (int)(jitter % (unsigned int)(delay / 2 + 1));
+  if (delay > busy->timeout - busy->wait)
+    delay = busy->timeout - busy->wait;
+  if (delay < 1)
+    delay = 1;
+
+  delay = sqlite3_sleep(delay);
+  busy->wait += delay;
+  busy->total_wait += delay;
+  if (busy->wait > busy->max_wait)
+    busy->max_wait = busy->wait;
+  return 1;
+}
+
+
+/*
+** Install the busy handler, or remove it if timeout is not positive.
+*/
+static void set_busy_handler(conn_data *conn, int timeout, int min_sleep,
+			     int max_sleep)
+{
+  conn->busy.timeout = timeout;
+  conn->busy.min_sleep = min_sleep > 0 ? min_sleep : 1;
+  conn->busy.max_sleep = max_sleep > conn->busy.min_sleep ?
+    max_sleep : conn->busy.min_sleep;
+  if (timeout > 0)
+    sqlite3_busy_handler(conn->sql_conn, busy_handler, conn);
+  else
+    sqlite3_busy_handler(conn->sql_conn, NULL, NULL);
+}
+
+
+/*
+** Set the time to wait for a lock, in milliseconds, and the bounds of
+** the backoff between retries (default 1 and 100 ms).
+** A nil or zero timeout makes locked statements fail immediately.
+*/
+static int conn_setbusyhandler(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  set_busy_handler(conn, (int)luaL_optinteger(L, 2, 0),
+		   (int)luaL_optinteger(L, 3, 1),
+		   (int)luaL_optinteger(L, 4, 100));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return a table with the busy handler counters: events, total_wait
+** and max_wait (in ms). If the argument is true, reset the counters.
+*/
+static int conn_busystats(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  lua_createtable(L, 0, 3);
+  lua_pushinteger(L, (lua_Integer)conn->busy.events);
+  lua_setfield(L, -2, "events");
+  lua_pushnumber(L, conn->busy.total_wait);
+  lua_setfield(L, -2, "total_wait");
+  lua_pushinteger(L, conn->busy.max_wait);
+  lua_setfield(L, -2, "max_wait");
+  if (lua_toboolean(L, 2))
+    {
+      conn->busy.events = 0;
+      conn->busy.total_wait = 0;
+      conn->busy.max_wait = 0;
+    }
+  return 1;
+}
+
+
+#ifdef LUASQL_SQLITE_VTAB
+/*
+** Return the module of a virtual table cursor.
+*/
+static module_data *vcur_module(sqlite3_vtab_cursor *cur)
+{
+  return ((vtab_data *)cur->pVtab)->module;
+}
+
+
+/*
+** Report the error message on top of the stack through the virtual
+** table and pop it.
+*/
+static int vtab_error(lua_State *L, sqlite3_vtab *vtab)
+{
+  sqlite3_free(vtab->zErrMsg);
+  vtab->zErrMsg = sqlite3_mprintf("%s", lua_tostring(L, -1));
+  lua_pop(L, 1);
+  return SQLITE_ERROR;
+}
+
+
+/*
+** Connect to the eponymous virtual table.
+*/
+static int vtab_connect(sqlite3 *db, void *aux, int argc,
+			const char *const *argv, sqlite3_vtab **vtab,
+			char **errmsg)
+{
+  module_data *module = (module_data *)aux;
+  vtab_data *v;
+  int res;
+  (void)argc; (void)argv; (void)errmsg;
+
+  res = sqlite3_declare_vtab(db, module->decl);
+  if (res != SQLITE_OK)
+    return res;
+  v = (vtab_data *)sqlite3_malloc(sizeof(vtab_data));
+  if (v == NULL)
+    return SQLITE_NOMEM;
+  memset(v, 0, sizeof(vtab_data));
+  v->module = module;
+  *vtab = &v->base;
+  return SQLITE_OK;
+}
+
+
+/*
+** Disconnect from the virtual table.
+*/
+static int vtab_disconnect(sqlite3_vtab *vtab)
+{
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+
+/*
+** Hand every equality constraint to xFilter. The indexes of the
+** constrained columns are passed in idxStr; SQLite still checks the
+** constraints of visible columns on the returned rows. Parameters
+** (the hidden columns) are only known through their constraints, so
+** plans that cannot give them a value are made prohibitive.
+*/
+static int vtab_bestindex(sqlite3_vtab *vtab, sqlite3_index_info *info)
+{
+  int numcols = ((vtab_data *)vtab)->module->numcols;
+  char *cols = NULL;
+  int i, n = 0;
+  double cost = 1000000.0;
+
+  for (i = 0; i < info->nConstraint; i++)
+    {
+      const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+      if (c->op != SQLITE_INDEX_CONSTRAINT_EQ || c->iColumn < 0)
+        continue;
+      if (c->usable)
+        {
+          info->aConstraintUsage[i].argvIndex = ++n;
+          info->aConstraintUsage[i].omit = c->iColumn >= numcols;
+          cols = sqlite3_mprintf("%z%d,", cols, c->iColumn);
+          if (cols == NULL)
+            return SQLITE_NOMEM;
+          cost /= 10.0;
+        }
+      else if (c->iColumn >= numcols)
+        cost *= 1e12;
+    }
+  info->idxStr = cols;
+  info->needToFreeIdxStr = 1;
+  info->estimatedCost = cost;
+  return SQLITE_OK;
+}
+
+
+/*
+** Open a cursor over the virtual table.
+*/
+static int vtab_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cur)
+{
+  vcur_data *vcur = (vcur_data *)sqlite3_malloc(sizeof(vcur_data));
+  (void)vtab;
+  if (vcur == NULL)
+    return SQLITE_NOMEM;
+  memset(vcur, 0, sizeof(vcur_data));
+  vcur->iter = LUA_NOREF;
+  vcur->row = LUA_NOREF;
+  vcur->args = LUA_NOREF;
+  *cur = &vcur->base;
+  return SQLITE_OK;
+}
+
+
+/*
+** Close a cursor over the virtual table.
+*/
+static int vtab_close(sqlite3_vtab_cursor *cur)
+{
+  vcur_data *vcur = (vcur_data *)cur;
+  lua_State *L = vcur_module(cur)->conn->L;
+  luaL_unref(L, LUA_REGISTRYINDEX, vcur->iter);
+  luaL_unref(L, LUA_REGISTRYINDEX, vcur->row);
+  luaL_unref(L, LUA_REGISTRYINDEX, vcur->args);
+  sqlite3_free(vcur);
+  return SQLITE_OK;
+}
+
+
+/*
+** Advance to the next row returned by the iterator.
+*/
+static int vtab_next(sqlite3_vtab_cursor *cur)
+{
+  vcur_data *vcur = (vcur_data *)cur;
+  lua_State *L = vcur_module(cur)->conn->L;
+
+  luaL_unref(L, LUA_REGISTRYINDEX, vcur->row);
+  vcur->row = LUA_NOREF;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, vcur->iter);
+  if (lua_pcall(L, 0, 1, 0) != 0)
+    return vtab_error(L, cur->pVtab);
+  if (lua_isnil(L, -1))  /* end of rows */
+    {
+      lua_pop(L, 1);
+      return SQLITE_OK;
+    }
+  if (!lua_istable(L, -1))
+    {
+      lua_pop(L, 1);
+      lua_pushliteral(L, LUASQL_PREFIX"iterator must return a table");
+      return vtab_error(L, cur->pVtab);
+    }
+  vcur->row = luaL_ref(L, LUA_REGISTRYINDEX);
+  vcur->rowid++;
+  return SQLITE_OK;
+}
+
+
+/*
+** Start a scan: call the factory with a table of the equality
+** constraints, indexed by column name, to obtain the iterator.
+*/
+static int vtab_filter(sqlite3_vtab_cursor *cur, int idxnum,
+		       const char *idxstr, int argc, sqlite3_value **argv)
+{
+  vcur_data *vcur = (vcur_data *)cur;
+  module_data *module = vcur_module(cur);
+  lua_State *L = module->conn->L;
+  int i;
+  (void)idxnum;
+
+  luaL_unref(L, LUA_REGISTRYINDEX, vcur->iter);
+  luaL_unref(L, LUA_REGISTRYINDEX, vcur->args);
+  vcur->iter = LUA_NOREF;
+  vcur->rowid = 0;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, module->factory);
+  lua_createtable(L, 0, argc);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, module->columns);
+  for (i = 0; i < argc && idxstr != NULL; i++)
+    {
+      int col = atoi(idxstr);
+      idxstr = strchr(idxstr, ',') + 1;
+      lua_rawgeti(L, -1, col + 1);
+      push_value(L, argv[i]);
+      lua_rawset(L, -4);
+    }
+  lua_pop(L, 1);  /* column names */
+  lua_pushvalue(L, -1);
+  vcur->args = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (lua_pcall(L, 1, 1, 0) != 0)
+    return vtab_error(L, cur->pVtab);
+  if (!lua_isfunction(L, -1))
+    {
+      lua_pop(L, 1);
+      lua_pushliteral(L, LUASQL_PREFIX"factory must return an iterator function");
+      return vtab_error(L, cur->pVtab);
+    }
+  vcur->iter = luaL_ref(L, LUA_REGISTRYINDEX);
+  return vtab_next(cur);
+}
+
+
+/*
+** Check for the end of the rows.
+*/
+static int vtab_eof(sqlite3_vtab_cursor *cur)
+{
+  return ((vcur_data *)cur)->row == LUA_NOREF;
+}
+
+
+/*
+** Return a column of the current row, taken from its positional
+** index or, if absent, from the column name. Parameters return the
+** value they were given.
+*/
+static int vtab_column(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int i)
+{
+  vcur_data *vcur = (vcur_data *)cur;
+  module_data *module = vcur_module(cur);
+  lua_State *L = module->conn->L;
+
+  if (i >= module->numcols)
+    {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, vcur->args);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, module->columns);
+      lua_rawgeti(L, -1, i + 1);
+      lua_rawget(L, -3);
+      lua_remove(L, -2);
+      set_result(ctx, L, -1);
+      lua_pop(L, 2);
+      return SQLITE_OK;
+    }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, vcur->row);
+  lua_rawgeti(L, -1, i + 1);
+  if (lua_isnil(L, -1))
+    {
+      lua_pop(L, 1);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, module->columns);
+      lua_rawgeti(L, -1, i + 1);
+      lua_rawget(L, -3);
+      lua_remove(L, -2);
+    }
+  set_result(ctx, L, -1);
+  lua_pop(L, 2);
+  return SQLITE_OK;
+}
+
+
+/*
+** Return the rowid of the current row: its position in the scan.
+*/
+static int vtab_rowid(sqlite3_vtab_cursor *cur, sqlite3_int64 *rowid)
+{
+  *rowid = ((vcur_data *)cur)->rowid;
+  return SQLITE_OK;
+}
+
+
+/*
+** Release a module registration.
+*/
+static void module_destroy(void *p)
+{
+  module_data *module = (module_data *)p;
+  lua_State *L = module->conn->L;
+  luaL_unref(L, LUA_REGISTRYINDEX, module->factory);
+  luaL_unref(L, LUA_REGISTRYINDEX, module->columns);
+  sqlite3_free(module->decl);
+  free(module);
+}
+
+
+/*
+** Eponymous-only (no xCreate), read-only (no xUpdate) module.
+*/
+static sqlite3_module lua_module = {
+  0,                  /* iVersion */
+  NULL,               /* xCreate */
+  vtab_connect,       /* xConnect */
+  vtab_bestindex,     /* xBestIndex */
+  vtab_disconnect,    /* xDisconnect */
+  vtab_disconnect,    /* xDestroy */
+  vtab_open,          /* xOpen */
+  vtab_close,         /* xClose */
+  vtab_filter,        /* xFilter */
+  vtab_next,          /* xNext */
+  vtab_eof,           /* xEof */
+  vtab_column,        /* xColumn */
+  vtab_rowid,         /* xRowid */
+  NULL,               /* xUpdate */
+  NULL,               /* xBegin */
+  NULL,               /* xSync */
+  NULL,               /* xCommit */
+  NULL,               /* xRollback */
+  NULL,               /* xFindFunction */
+  NULL,               /* xRename */
+  NULL,               /* xSavepoint */
+  NULL,               /* xRelease */
+  NULL,               /* xRollbackTo */
+#if SQLITE_VERSION_NUMBER >= 3026000
+  NULL,               /* xShadowName */
+#endif
+#if SQLITE_VERSION_NUMBER >= 3044000
+  NULL,               /* xIntegrity */
+#endif
+};
+
+
+/*
+** Expose a Lua iterator as an eponymous read-only virtual table.
+** Arguments: name, columns (list of column names), factory [, params].
+** factory(constraints) receives the equality constraints of the query,
+** indexed by column name, and returns an iterator; each call of the
+** iterator returns a row, as a table indexed by position or by column
+** name, or nil at the end. params lists the names of hidden columns
+** that take the arguments of the table-valued function form,
+** name(arg, ...), and reach the factory as constraints.
+*/
+static int conn_createvtab(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *name = luaL_checkstring(L, 2);
+  int numcols, numparams = 0, i, res;
+  module_data *module;
+  char *decl;
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  luaL_checktype(L, 4, LUA_TFUNCTION);
+  if (!lua_isnoneornil(L, 5))
+    {
+      luaL_checktype(L, 5, LUA_TTABLE);
+      numparams = (int)lua_objlen(L, 5);
+    }
+  if (conn->pool != NULL)
+    return luasql_faildirect(L, "not allowed on a pooled connection");
+  numcols = (int)lua_objlen(L, 3);
+  luaL_argcheck(L, numcols > 0, 3, LUASQL_PREFIX"column list expected");
+
+  /* copy the column names and build the table declaration */
+  lua_createtable(L, numcols + numparams, 0);
+  decl = sqlite3_mprintf("CREATE TABLE x(");
+  for (i = 1; i <= numcols + numparams && decl != NULL; i++)
+    {
+      int arg = i <= numcols ? 3 : 5;
+      lua_rawgeti(L, arg, i <= numcols ? i : i - numcols);
+      if (lua_type(L, -1) != LUA_TSTRING)
+        {
+          sqlite3_free(decl);
+          return luaL_argerror(L, arg, LUASQL_PREFIX"column names must be strings");
+        }
+      decl = sqlite3_mprintf("%z%s\"%w\"%s", decl, i > 1 ? "," : "",
+			     lua_tostring(L, -1), arg == 5 ? " HIDDEN" : "");
+      lua_rawseti(L, -2, i);
+    }
+  if (decl != NULL)
+    decl = sqlite3_mprintf("%z)", decl);
+  module = (module_data *)malloc(sizeof(module_data));
+  if (decl == NULL || module == NULL)
+    {
+      sqlite3_free(decl);
+      free(module);
+      return luaL_error(L, LUASQL_PREFIX"out of memory");
+    }
+
+  module->conn = conn;
+  module->decl = decl;
+  module->numcols = numcols;
+  module->columns = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, 4);
+  module->factory = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  /* on failure SQLite calls module_destroy itself */
+  res = sqlite3_create_module_v2(conn->sql_conn, name, &lua_module, module,
+				 module_destroy);
+  if (res != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+#endif
+
+
+/*
+** Commit the current transaction.
+*/
+static int conn_commit(lua_State *L)
+{
+  char *errmsg;
+  conn_data *conn = getconnection(L);
+  int res;
+  const char *sql = "COMMIT";
+
+  if (conn->auto_commit == 0) sql = "COMMIT;BEGIN";
+
+  res = sqlite3_exec(conn->sql_conn, sql, NULL, NULL, &errmsg);
+
+  if (res != SQLITE_OK)
+    {
+      lua_pushnil(L);
+      lua_pushliteral(L, LUASQL_PREFIX);
+      lua_pushstring(L, errmsg);
+      sqlite3_free(errmsg);
+      lua_concat(L, 2);
+      return 2;
+    }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Rollback the current transaction.
+*/
+static int conn_rollback(lua_State *L)
+{
+  char *errmsg;
+  conn_data *conn = getconnection(L);
+  int res;
+  const char *sql = "ROLLBACK";
+
   if (conn->auto_commit == 0) sql = "ROLLBACK;BEGIN";
 
   res = sqlite3_exec(conn->sql_conn, sql, NULL, NULL, &errmsg);
@@ -472,7 +2022,18 @@ static int conn_rollback(lua_State *L)
 static int conn_getlastautoid(lua_State *L)
 {
   conn_data *conn = getconnection(L);
-  lua_pushnumber(L, sqlite3_last_insert_rowid(conn->sql_conn));
+  push_int64(L, sqlite3_last_insert_rowid(conn->sql_conn));
+  return 1;
+}
+
+
+/*
+** Return the number of rows changed since the connection was opened.
+*/
+static int conn_totalchanges(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  push_int64(L, sqlite_total_changes(conn->sql_conn));
   return 1;
 }
 
@@ -525,14 +2086,97 @@ static int create_connection(lua_State *L, int env, sqlite3 *sql_conn)
   conn->auto_commit = 1;
   conn->sql_conn = sql_conn;
   conn->cur_counter = 0;
+  conn->blob_counter = 0;
+  conn->timed_out = 0;
+  conn->deadline = 0;
+  conn->busy.timeout = 0;
+  conn->busy.min_sleep = 1;
+  conn->busy.max_sleep = 100;
+  conn->busy.wait = 0;
+  conn->busy.events = 0;
+  conn->busy.total_wait = 0;
+  conn->busy.max_wait = 0;
+  conn->pool = NULL;
+  conn->pool_writer = 0;
+  conn->L = L;
   lua_pushvalue (L, env);
   conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
   return 1;
 }
 
 
+/*
+** Compute the sqlite3_open_v2 flags from the options table.
+*/
+static int open_flags(lua_State *L, int opts)
+{
+  int flags;
+  if (opts == 0)
+    return SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+  if (opt_flag(L, opts, "readonly"))
+    flags = SQLITE_OPEN_READONLY;
+  else
+    flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  if (opt_flag(L, opts, "nomutex"))
+    flags |= SQLITE_OPEN_NOMUTEX;
+  if (opt_flag(L, opts, "sharedcache"))
+    flags |= SQLITE_OPEN_SHAREDCACHE;
+  if (opt_flag(L, opts, "uri"))
+    flags |= SQLITE_OPEN_URI;
+  return flags;
+}
+
+
+/*
+** Execute "PRAGMA name=value" if field `name' is set in the options table.
+** Return the sqlite3_exec result; errmsg must be freed by the caller.
+*/
+static int apply_pragma(lua_State *L, sqlite3 *db, int opts, const char *name,
+			char **errmsg)
+{
+  char *sql = NULL;
+  int res = SQLITE_OK;
+
+  lua_getfield(L, opts, name);
+  if (lua_type(L, -1) == LUA_TNUMBER)
+    sql = sqlite3_mprintf("PRAGMA %s=%lld", name,
+			  (sqlite3_int64)lua_tonumber(L, -1));
+  else if (lua_type(L, -1) == LUA_TSTRING)
+    sql = sqlite3_mprintf("PRAGMA %s=%Q", name, lua_tostring(L, -1));
+  lua_pop(L, 1);
+
+  if (sql != NULL)
+    {
+      res = sqlite3_exec(db, sql, NULL, NULL, errmsg);
+      sqlite3_free(sql);
+    }
+  return res;
+}
+
+
+/*
+** Apply the tuning pragmas of the options table, in an order that
+** keeps them valid (page_size must precede the switch to WAL).
+*/
+static int apply_pragmas(lua_State *L, sqlite3 *db, int opts, char **errmsg)
+{
+  static const char *const pragmas[] = {
+    "page_size", "journal_mode", "synchronous",
+    "cache_size", "mmap_size", "temp_store", NULL
+  };
+  int i, res = SQLITE_OK;
+
+  for (i = 0; pragmas[i] != NULL && res == SQLITE_OK; i++)
+    res = apply_pragma(L, db, opts, pragmas[i], errmsg);
+  return res;
+}
+
+
 /*
 ** Connects to a data source.
+** The optional third argument is either the lock timeout in
+** milliseconds or a table of open options and pragmas.
 */
 static int env_connect(lua_State *L)
 {
@@ -540,11 +2184,22 @@ static int env_connect(lua_State *L)
   sqlite3 *conn;
   const char *errmsg;
   int res;
+  int opts = 0;
+  int timeout = 0;
   getenvironment(L);  /* validate environment */
 
   sourcename = luaL_checkstring(L, 2);
+  if (lua_istable(L, 3))
+    {
+      opts = 3;
+      lua_getfield(L, opts, "timeout");
+      timeout = (int)lua_tonumber(L, -1);
+      lua_pop(L, 1);
+    }
+  else if (lua_isnumber(L, 3))
+    timeout = (int)lua_tonumber(L, 3);
 
-  res = sqlite3_open(sourcename, &conn);
+  res = sqlite3_open_v2(sourcename, &conn, open_flags(L, opts), NULL);
   if (res != SQLITE_OK)
     {
       errmsg = sqlite3_errmsg(conn);
@@ -553,12 +2208,305 @@ static int env_connect(lua_State *L)
       return 2;
     }
 
-  if (lua_isnumber(L, 3)) {
-  	sqlite3_busy_timeout(conn, lua_tonumber(L,3)); /* TODO: remove this */
-  }
+  if (opts != 0)
+    {
+      char *pragma_err = NULL;
+
+      /* the busy handler needs the connection object: use a plain
+         timeout while the pragmas are applied */
+      sqlite3_busy_timeout(conn, timeout);
+      if (apply_pragmas(L, conn, opts, &pragma_err) != SQLITE_OK)
+        {
+          lua_pushnil(L);
+          lua_pushliteral(L, LUASQL_PREFIX);
+          lua_pushstring(L, pragma_err ? pragma_err : sqlite3_errmsg(conn));
+          lua_concat(L, 2);
+          sqlite3_free(pragma_err);
+          sqlite3_close(conn);
+          return 2;
+        }
+    }
+
+  create_connection(L, 1, conn);
+  if (timeout > 0)
+    set_busy_handler((conn_data *)lua_touserdata(L, -1), timeout, 1, 100);
+  return 1;
+}
+
+
+#ifdef LUASQL_SQLITE_SERIALIZE
+/*
+** Create an in-memory connection over a copy of a database image
+** produced by conn:serialize.
+** Arguments: image [, readonly].
+*/
+static int env_deserialize(lua_State *L)
+{
+  size_t len;
+  const char *image;
+  int readonly = lua_toboolean(L, 3);
+  unsigned int flags = SQLITE_DESERIALIZE_FREEONCLOSE;
+  unsigned char *buf;
+  sqlite3 *conn;
+  getenvironment(L);  /* validate environment */
+
+  image = luaL_checklstring(L, 2, &len);
+  if (sqlite3_open_v2(":memory:", &conn,
+		      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+    {
+      luasql_faildirect(L, sqlite3_errmsg(conn));
+      sqlite3_close(conn);
+      return 2;
+    }
+
+  buf = (unsigned char *)sqlite3_malloc64(len > 0 ? len : 1);
+  if (buf == NULL)
+    {
+      sqlite3_close(conn);
+      return luasql_faildirect(L, "out of memory");
+    }
+  memcpy(buf, image, len);
+  flags |= readonly ? SQLITE_DESERIALIZE_READONLY : SQLITE_DESERIALIZE_RESIZEABLE;
+
+  /* on failure SQLite frees buf itself */
+  if (sqlite3_deserialize(conn, "main", buf, (sqlite3_int64)len,
+			  (sqlite3_int64)len, flags) != SQLITE_OK)
+    {
+      luasql_faildirect(L, sqlite3_errmsg(conn));
+      sqlite3_close(conn);
+      return 2;
+    }
 
   return create_connection(L, 1, conn);
 }
+#endif
+
+
+/*
+** Find the pool of a database, creating it if needed.
+** Must be called with the pool list locked.
+*/
+static pool_data *pool_find(const char *path, int size, int flags)
+{
+  pool_data *pool;
+  for (pool = pools; pool != NULL; pool = pool->next)
+    if (strcmp(pool->path, path) == 0)
+      return pool;
+
+  pool = (pool_data *)malloc(sizeof(pool_data));
+  if (pool == NULL)
+    return NULL;
+  memset(pool, 0, sizeof(pool_data));
+  pool->path = (char *)malloc(strlen(path) + 1);
+  pool->readers = (sqlite3 **)malloc(size * sizeof(sqlite3 *));
+  if (pool->path == NULL || pool->readers == NULL)
+    {
+      free(pool->path);
+      free(pool->readers);
+      free(pool);
+      return NULL;
+    }
+  strcpy(pool->path, path);
+  pool->size = size;
+  pool->flags = flags;
+  pool->next = pools;
+  pools = pool;
+  return pool;
+}
+
+
+/*
+** Take a handle from the pool, opening a new one while the pool is
+** not full, or wait up to timeout ms for one to be checked in.
+** Return SQLITE_OK, SQLITE_BUSY on timeout, or an open error.
+*/
+static int pool_take(pool_data *pool, int write, int timeout, sqlite3 **db)
+{
+  int waited = 0, interval = 1, slept;
+  int res = SQLITE_OK;
+
+  *db = NULL;
+  pool_lock();
+  for (;;)
+    {
+      if (write ? !pool->writer_busy : pool->idle > 0)
+        {
+          if (write)
+            {
+              pool->writer_busy = 1;
+              *db = pool->writer;
+            }
+          else
+            *db = pool->readers[--pool->idle];
+          break;
+        }
+      if (!write && pool->opened < pool->size)
+        {
+          pool->opened++;
+          break;
+        }
+      if (waited >= timeout)
+        {
+          pool->timeouts++;
+          pool_unlock();
+          return SQLITE_BUSY;
+        }
+      pool_unlock();
+      /* back off up to 16 ms; count at least the time asked for, so
+         a VFS that cannot sleep still reaches the timeout */
+      if (interval > timeout - waited)
+        interval = timeout - waited;
+      slept = sqlite3_sleep(interval);
+      waited += slept > interval ? slept : interval;
+      if (interval < 16)
+        interval *= 2;
+      pool_lock();
+    }
+  if (*db != NULL)
+    pool->checkouts++;
+  if (waited > 0)
+    {
+      pool->waits++;
+      pool->total_wait += waited;
+      if (waited > pool->max_wait)
+        pool->max_wait = waited;
+    }
+  pool_unlock();
+
+  if (*db == NULL)  /* open a new handle outside the lock */
+    {
+      int flags = write ?
+        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX :
+        pool->flags;
+      res = sqlite3_open_v2(pool->path, db, flags, NULL);
+      pool_lock();
+      if (res != SQLITE_OK)
+        {
+          if (write)
+            pool->writer_busy = 0;
+          else
+            pool->opened--;
+        }
+      else
+        {
+          if (write)
+            pool->writer = *db;
+          pool->checkouts++;
+        }
+      pool_unlock();
+    }
+  return res;
+}
+
+
+/*
+** Check out a connection from the process-wide pool of a database.
+** Options: size (maximum number of readers, default 4), timeout (ms to
+** wait for a free connection, default 1000, 0 to fail at once), write
+** (check out the writer connection instead of a reader) and
+** sharedcache (open readers in shared-cache mode). Size and
+** sharedcache are fixed when the pool is created; a later checkout
+** asking for other values raises an error.
+** Closing the connection returns it to the pool.
+*/
+static int env_checkout(lua_State *L)
+{
+  const char *path;
+  int size = 0, timeout = 1000, write = 0, shared = -1, flags;
+  pool_data *pool;
+  sqlite3 *db;
+  conn_data *conn;
+  int res, mismatch;
+  getenvironment(L);  /* validate environment */
+
+  path = luaL_checkstring(L, 2);
+  flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX;
+  if (lua_istable(L, 3))
+    {
+      size = (int)opt_integer(L, 3, "size", 0);
+      timeout = (int)opt_integer(L, 3, "timeout", timeout);
+      write = opt_flag(L, 3, "write");
+      lua_getfield(L, 3, "sharedcache");
+      if (!lua_isnil(L, -1))
+        shared = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+    }
+  luaL_argcheck(L, size >= 0, 3, LUASQL_PREFIX"invalid pool size");
+  luaL_argcheck(L, timeout >= 0, 3, LUASQL_PREFIX"invalid pool timeout");
+  if (shared == 1)
+    flags |= SQLITE_OPEN_SHAREDCACHE;
+
+  pool_lock();
+  pool = pool_find(path, size > 0 ? size : 4, flags);
+  mismatch = pool != NULL &&
+    ((size > 0 && size != pool->size) ||
+     (shared != -1 && flags != pool->flags));
+  pool_unlock();
+  if (pool == NULL)
+    return luaL_error(L, LUASQL_PREFIX"out of memory");
+  if (mismatch)
+    return luaL_error(L, LUASQL_PREFIX"pool of `%s' was created with other options",
+		      path);
+
+  res = pool_take(pool, write, timeout, &db);
+  if (res == SQLITE_BUSY)
+    return luasql_faildirect(L, "pool exhausted");
+  if (res != SQLITE_OK)
+    {
+      luasql_faildirect(L, db ? sqlite3_errmsg(db) : "cannot open database");
+      sqlite3_close(db);
+      return 2;
+    }
+
+  create_connection(L, 1, db);
+  conn = (conn_data *)lua_touserdata(L, -1);
+  conn->pool = pool;
+  conn->pool_writer = (short)write;
+  return 1;
+}
+
+
+/*
+** Return a table with the counters of the pool of a database, or nil
+** if there is no pool for it.
+*/
+static int env_poolstats(lua_State *L)
+{
+  const char *path;
+  pool_data *pool;
+  getenvironment(L);  /* validate environment */
+
+  path = luaL_checkstring(L, 2);
+  pool_lock();
+  for (pool = pools; pool != NULL; pool = pool->next)
+    if (strcmp(pool->path, path) == 0)
+      break;
+  if (pool == NULL)
+    {
+      pool_unlock();
+      lua_pushnil(L);
+      return 1;
+    }
+  lua_createtable(L, 0, 8);
+  lua_pushinteger(L, pool->size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, pool->opened);
+  lua_setfield(L, -2, "opened");
+  lua_pushinteger(L, pool->idle);
+  lua_setfield(L, -2, "idle");
+  lua_pushinteger(L, (lua_Integer)pool->checkouts);
+  lua_setfield(L, -2, "checkouts");
+  lua_pushinteger(L, (lua_Integer)pool->waits);
+  lua_setfield(L, -2, "waits");
+  lua_pushinteger(L, (lua_Integer)pool->timeouts);
+  lua_setfield(L, -2, "timeouts");
+  lua_pushnumber(L, pool->total_wait);
+  lua_setfield(L, -2, "total_wait");
+  lua_pushinteger(L, pool->max_wait);
+  lua_setfield(L, -2, "max_wait");
+  pool_unlock();
+  return 1;
+}
 
 
 /*
@@ -590,17 +2538,6 @@ static int env_close (lua_State *L)
 }
 
 
-/*
-** Sets the timeout for a lock in the connection.
-static int opts_settimeout  (lua_State *L)
-{
-	conn_data *conn = getconnection(L);
-	int milisseconds = luaL_checknumber(L, 2);
-	lua_pushnumber(L, sqlite3_busy_timeout(conn->sql_conn, milisseconds));
-	return 1;
-}
-*/
-
 /*
 ** Create metatables for each class of object.
 */
@@ -610,6 +2547,11 @@ static void create_metatables (lua_State *L)
     {"__gc", env_gc},
     {"close", env_close},
     {"connect", env_connect},
+    {"checkout", env_checkout},
+    {"poolstats", env_poolstats},
+#ifdef LUASQL_SQLITE_SERIALIZE
+    {"deserialize", env_deserialize},
+#endif
     {NULL, NULL},
   };
   struct luaL_Reg connection_methods[] = {
@@ -621,6 +2563,21 @@ static void create_metatables (lua_State *L)
     {"rollback", conn_rollback},
     {"setautocommit", conn_setautocommit},
     {"getlastautoid", conn_getlastautoid},
+    {"totalchanges", conn_totalchanges},
+    {"blobopen", conn_blobopen},
+    {"createfunction", conn_createfunction},
+    {"createaggregate", conn_createaggregate},
+    {"backup", conn_backup},
+    {"setdeadline", conn_setdeadline},
+    {"interrupt", conn_interrupt},
+    {"setbusyhandler", conn_setbusyhandler},
+    {"busystats", conn_busystats},
+#ifdef LUASQL_SQLITE_VTAB
+    {"createvtab", conn_createvtab},
+#endif
+#ifdef LUASQL_SQLITE_SERIALIZE
+    {"serialize", conn_serialize},
+#endif
     {NULL, NULL},
   };
   struct luaL_Reg cursor_methods[] = {
@@ -629,12 +2586,24 @@ static void create_metatables (lua_State *L)
     {"getcolnames", cur_getcolnames},
     {"getcoltypes", cur_getcoltypes},
     {"fetch", cur_fetch},
+    {"fetchcolumns", cur_fetchcolumns},
+    {"status", cur_status},
+    {NULL, NULL},
+  };
+  struct luaL_Reg blob_methods[] = {
+    {"__gc", blob_gc},
+    {"close", blob_close},
+    {"read", blob_read},
+    {"write", blob_write},
+    {"size", blob_size},
+    {"reopen", blob_reopen},
     {NULL, NULL},
   };
   luasql_createmeta(L, LUASQL_ENVIRONMENT_SQLITE, environment_methods);
   luasql_createmeta(L, LUASQL_CONNECTION_SQLITE, connection_methods);
   luasql_createmeta(L, LUASQL_CURSOR_SQLITE, cursor_methods);
-  lua_pop (L, 3);
+  luasql_createmeta(L, LUASQL_BLOB_SQLITE, blob_methods);
+  lua_pop (L, 4);
 }
 
 /*
@@ -18,6 +18,10 @@
 	lua_pushnumber(L, (lua_Number)n)
 #endif
 
+#if defined LUA_VERSION_NUM && LUA_VERSION_NUM >= 502 && !defined lua_objlen
+#define lua_objlen(L, i) lua_rawlen(L, i)
+#endif
+
 #define LUASQL_PREFIX "LuaSQL: "
 #define LUASQL_TABLENAME "luasql"
 #define LUASQL_ENVIRONMENT "Each driver must have an environment metatable"
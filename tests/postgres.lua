@@ -5,3 +5,442 @@
 
 table.insert (CUR_METHODS, "numrows")
 table.insert (EXTENSIONS, numrows)
+
+---------------------------------------------------------------------
+-- Streaming cursors.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	local cur = CUR_OK (CONN:stream ("select generate_series (1, 100) as n", 10))
+	local total = 0
+	local n = cur:fetch ()
+	while n do
+		total = total + tonumber (n)
+		n = cur:fetch ()
+	end
+	assert2 (5050, total)
+	assert2 (false, cur:close ())
+
+	-- closing early leaves the connection usable
+	cur = CUR_OK (CONN:stream "select generate_series (1, 100000)")
+	assert2 ("1", cur:fetch ())
+	assert2 (nil, cur:numrows ())
+	assert2 (true, cur:close ())
+	cur = CUR_OK (CONN:execute "select 1")
+	assert2 ("1", cur:fetch ())
+	cur:close ()
+
+	-- and does not abort a transaction begun by the user
+	assert (CONN:execute "begin")
+	assert (CONN:execute "create temporary table luasql_stream (x integer)")
+	cur = CUR_OK (CONN:stream "select generate_series (1, 100000)")
+	assert2 ("1", cur:fetch ())
+	assert2 (true, cur:close ())
+	assert2 (1, CONN:execute "insert into luasql_stream values (1)")
+	assert (CONN:execute "commit")
+	assert (CONN:execute "drop table luasql_stream")
+
+	assert2 (nil, CONN:stream "select * from unknown_table")
+	io.write (" stream")
+end)
+
+---------------------------------------------------------------------
+-- Server-side cursors.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	local cur = CUR_OK (CONN:declare ("select generate_series (1, 25)", 10))
+	local count = 0
+	while cur:fetch () do
+		count = count + 1
+	end
+	assert2 (25, count)
+	assert2 (false, cur:close ())
+
+	cur = CUR_OK (CONN:declare ("select generate_series (1, 20)", 10))
+	assert2 ("1", cur:fetch ())
+	assert2 (nil, cur:numrows ())
+	assert2 (true, cur:close ())
+
+	assert2 (nil, CONN:declare "select * from unknown_table")
+	cur = CUR_OK (CONN:execute "select 1")
+	assert2 ("1", cur:fetch ())
+	cur:close ()
+
+	-- statements run while cursors are open are still committed on their own
+	assert (CONN:execute "create temporary table luasql_hold (x integer)")
+	local a = CUR_OK (CONN:declare ("select generate_series (1, 4)", 2))
+	local b = CUR_OK (CONN:declare ("select generate_series (5, 8)", 2))
+	assert2 ("1", a:fetch ())
+	assert2 (1, CONN:execute "insert into luasql_hold values (1)")
+	assert2 (nil, CONN:execute "select * from unknown_table")
+	assert2 ("5", b:fetch ())
+	assert2 (true, a:close ())
+	for i = 6, 8 do
+		assert2 (tostring (i), b:fetch ())
+	end
+	assert2 (nil, b:fetch ())
+	cur = CUR_OK (CONN:execute "select count(*) from luasql_hold")
+	assert2 ("1", cur:fetch ())
+	cur:close ()
+	assert (CONN:execute "drop table luasql_hold")
+
+	-- a transaction begun by the user is not ended by the cursor
+	assert (CONN:execute "begin")
+	assert (CONN:execute "create temporary table luasql_declare (x integer)")
+	cur = CUR_OK (CONN:declare "select 1")
+	assert2 (true, cur:close ())
+	assert (CONN:execute "rollback")
+	assert2 (nil, CONN:execute "select * from luasql_declare")
+	io.write (" declare")
+end)
+
+---------------------------------------------------------------------
+-- Prepared statements.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	local stmt = assert (CONN:prepare (nil, "select $1::integer + $2::integer, $3::text is null"))
+	for i = 1, 3 do
+		local cur = CUR_OK (stmt:execute (i, 10, nil))
+		local sum, isnull = cur:fetch ()
+		assert2 (tostring (i + 10), sum)
+		assert2 ("t", isnull)
+		cur:close ()
+	end
+	assert2 (false, pcall (stmt.execute, stmt, 1))
+	assert2 (true, stmt:close ())
+	assert2 (false, stmt:close ())
+
+	stmt = assert (CONN:prepare ("luasql_named", "select $1::text"))
+	local cur = CUR_OK (stmt:execute "it's")
+	assert2 ("it's", cur:fetch ())
+	cur:close ()
+	assert2 (nil, CONN:prepare ("luasql_named", "select 1"))
+	assert2 (true, stmt:close ())
+	assert (CONN:prepare ("luasql_named", "select 1")):close ()
+
+	assert2 (nil, CONN:prepare (nil, "select * from unknown_table"))
+	io.write (" prepare")
+end)
+
+---------------------------------------------------------------------
+-- Binary result format.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	assert2 (true, CONN:setbinary (true))
+	local cur = CUR_OK (CONN:execute [[select true, 12::int2, -34::int4,
+		5000000000::int8, 1.5::float4, -0.25::float8, 'a\000b'::bytea,
+		'text', timestamp '1970-01-02 00:00:00', null::int4]])
+	local b, i2, i4, i8, f4, f8, bytes, text, ts, null = cur:fetch ()
+	assert2 (true, b)
+	assert2 (12, i2)
+	assert2 (-34, i4)
+	assert2 (5000000000, i8)
+	assert2 (1.5, f4)
+	assert2 (-0.25, f8)
+	assert2 ("a\0b", bytes)
+	assert2 ("text", text)
+	assert2 (86400, ts)
+	assert2 (nil, null)
+	cur:close ()
+	assert2 (true, CONN:setbinary (false))
+	cur = CUR_OK (CONN:execute "select 12::int2")
+	assert2 ("12", cur:fetch ())
+	cur:close ()
+	io.write (" binary")
+end)
+
+---------------------------------------------------------------------
+-- Type names cache.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	local sql = "select 1::int4, 'a'::varchar(5), 1.5::numeric, null::tsvector"
+	local cur = CUR_OK (CONN:execute (sql))
+	local types = cur:getcoltypes ()
+	assert2 ("int4", types[1])
+	assert2 ("varchar (5)", types[2])
+	assert2 ("numeric", types[3])
+	assert2 ("tsvector", types[4])
+	cur:close ()
+	assert2 (true, CONN:cleartypecache ())
+	cur = CUR_OK (CONN:execute (sql))
+	assert2 ("tsvector", cur:getcoltypes ()[4])
+	cur:close ()
+
+	-- no lookup is possible while the rows are still being streamed
+	assert2 (true, CONN:cleartypecache ())
+	cur = CUR_OK (CONN:stream (sql))
+	types = cur:getcoltypes ()
+	assert2 ("int4", types[1])
+	assert2 ("undefined", types[4])
+	assert2 ("1", cur:fetch ())
+	assert2 (nil, cur:fetch ())
+	cur = CUR_OK (CONN:execute (sql))
+	assert2 ("tsvector", cur:getcoltypes ()[4])
+	cur:close ()
+	io.write (" typecache")
+end)
+
+---------------------------------------------------------------------
+-- COPY from and to the client.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	assert (CONN:execute "create temporary table test_copy (a text, b integer)")
+	local rows = {
+		{ "plain", 1 },
+		{ "tab\tand\nnewline \\", 2 },
+		{ n = 2, nil, 3 },
+		{ "", 4 },
+	}
+	local i = 0
+	assert2 (4, CONN:copyin ("copy test_copy from stdin", function ()
+		i = i + 1
+		return rows[i]
+	end))
+	i = 0
+	assert2 (4, CONN:copyin ("copy test_copy from stdin csv", function ()
+		i = i + 1
+		return rows[i]
+	end, "csv"))
+	assert2 (1, CONN:copyin ("copy test_copy from stdin", coroutine.wrap (function ()
+		coroutine.yield "raw\t5\n"
+	end)))
+
+	local seen = {}
+	assert2 (9, CONN:copyout ("copy (select * from test_copy order by b) to stdout csv", function (row)
+		table.insert (seen, row)
+	end, "csv"))
+	assert2 ("tab\tand\nnewline \\", seen[3][1])
+	assert2 (nil, seen[5][1])
+	assert2 ("3", seen[5][2])
+	assert2 ("", seen[7][1])
+	assert2 ("raw", seen[9][1])
+
+	local lines = 0
+	assert2 (9, CONN:copyout ("copy test_copy to stdout", function (line)
+		lines = lines + 1
+	end))
+	assert2 (9, lines)
+
+	-- errors finish the copy and leave the connection usable
+	assert2 (nil, CONN:copyin ("copy test_copy from stdin", function ()
+		error "source failure"
+	end))
+	assert2 (nil, CONN:copyout ("copy test_copy to stdout", function ()
+		error "sink failure"
+	end))
+	assert2 (nil, CONN:copyin ("select 1", function () end))
+	assert (CONN:execute "drop table test_copy")
+	io.write (" copy")
+end)
+
+---------------------------------------------------------------------
+-- Pipeline mode.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	if not CONN.pipeline then
+		io.write (" (no pipeline)")
+		return
+	end
+	assert (CONN:execute "create temporary table test_pipeline (n integer)")
+	local results = assert (CONN:pipeline (function (p)
+		for i = 1, 10 do
+			assert2 (true, p:execute ("insert into test_pipeline values ($1)", i))
+		end
+		p:execute "select sum(n) from test_pipeline"
+	end))
+	for i = 1, 10 do
+		assert2 (1, results[i])
+	end
+	assert2 ("55", results[11]:fetch ())
+	results[11]:close ()
+
+	local saved
+	assert2 (nil, CONN:pipeline (function (p)
+		saved = p
+		p:execute "insert into test_pipeline values (11)"
+		p:execute "select * from unknown_table"
+		p:execute "insert into test_pipeline values (12)"
+	end))
+	assert2 (false, pcall (saved.execute, saved, "select 1"))
+	assert2 (false, pcall (CONN.pipeline, CONN, function (p) error "failure" end))
+	local cur = CUR_OK (CONN:execute "select count(*) from test_pipeline")
+	assert2 ("10", cur:fetch ())
+	cur:close ()
+	assert (CONN:execute "drop table test_pipeline")
+	io.write (" pipeline")
+end)
+
+---------------------------------------------------------------------
+-- Asynchronous execution.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	assert2 ("number", type (CONN:socket ()))
+	assert2 (true, CONN:send ("select $1::integer * 2", 21))
+	while CONN:isbusy () do
+		assert2 (true, CONN:consume ())
+	end
+	local cur = CUR_OK (CONN:result ())
+	assert2 ("42", cur:fetch ())
+	cur:close ()
+	assert2 (nil, CONN:result ())
+
+	assert2 (true, CONN:send "select 1; select * from unknown_table")
+	cur = CUR_OK (CONN:result ())
+	cur:close ()
+	local ok, err = CONN:result ()
+	assert2 (nil, ok)
+	assert2 ("string", type (err))
+	assert2 (nil, CONN:result ())
+	io.write (" async")
+end)
+
+---------------------------------------------------------------------
+-- Notifications.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	assert (CONN:execute "listen luasql_test")
+	assert2 (0, #CONN:notifications ())
+	assert (CONN:execute "notify luasql_test, 'first'")
+	assert (CONN:execute "notify luasql_test, 'second'")
+	local list = assert (CONN:notifications (1))
+	assert2 (1, #list)
+	assert2 ("luasql_test", list[1].channel)
+	assert2 ("first", list[1].payload)
+	assert2 ("number", type (list[1].pid))
+	list = assert (CONN:notifications ())
+	assert2 ("second", list[1].payload)
+	assert2 (nil, list[2])
+	assert (CONN:execute "unlisten luasql_test")
+	io.write (" notifications")
+end)
+
+---------------------------------------------------------------------
+-- Non-blocking connection.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	local pend = assert (ENV:connect_start {
+		dbname = datasource, user = username, password = password,
+	})
+	assert2 ("number", type (pend:socket ()))
+	local state, conn = pend:poll ()
+	while state == "reading" or state == "writing" do
+		state, conn = pend:poll ()
+	end
+	assert2 ("ok", state, conn)
+	CONN_OK (conn)
+	assert2 (false, pend:close ())
+	local cur = CUR_OK (conn:execute "select 1")
+	assert2 ("1", cur:fetch ())
+	cur:close ()
+	assert2 (true, conn:close ())
+
+	-- the failure may be detected when starting or when polling
+	pend = ENV:connect_start "host=/nonexistent/dir"
+	if pend then
+		repeat
+			state = pend:poll ()
+		until state ~= "reading" and state ~= "writing"
+		assert2 (nil, state)
+		assert2 (true, pend:close ())
+	end
+	io.write (" connect_start")
+end)
+
+---------------------------------------------------------------------
+-- Length-aware values and fetching many rows at once.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	local cur = CUR_OK (CONN:execute "select generate_series (1, 5) as n, 'x' as s")
+	local rows = cur:fetchmany (2, "an")
+	assert2 (2, #rows)
+	assert2 ("1", rows[1].n)
+	assert2 ("x", rows[2].s)
+	assert2 ("2", rows[2][1])
+	rows = cur:fetchmany (10)
+	assert2 (3, #rows)
+	assert2 ("5", rows[3][1])
+	assert2 (nil, cur:fetchmany (10))
+	assert2 (false, cur:close ())
+
+	cur = CUR_OK (CONN:stream "select generate_series (1, 5)")
+	assert2 (5, #cur:fetchmany (10))
+	assert2 (nil, cur:fetchmany (10))
+
+	-- full batches are returned without looking for the next row
+	cur = CUR_OK (CONN:declare ("select generate_series (1, 4)", 2))
+	assert2 (2, #cur:fetchmany (2))
+	assert2 ("4", cur:fetchmany (2)[2][1])
+	assert2 (nil, cur:fetchmany (2))
+	io.write (" fetchmany")
+end)
+
+---------------------------------------------------------------------
+-- Large objects.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	local chunks = { "hello, ", "large ", "object" }
+	local i = 0
+	local oid = assert (CONN:lo_import_stream (function ()
+		i = i + 1
+		return chunks[i]
+	end))
+	local lo = assert (CONN:lo_open (oid, "rw"))
+	assert2 ("hello", lo:read (5))
+	assert2 (5, lo:tell ())
+	assert2 (5, lo:seek ())
+	assert2 (19, lo:seek ("end"))
+	assert2 (1, lo:write "!")
+	assert2 (7, lo:seek ("set", 7))
+	assert2 ("large object!", lo:read (100))
+	assert2 (nil, lo:read ())
+	-- streams share the transaction of the open object instead of ending it
+	assert2 (20, CONN:lo_export_stream (oid, function () end))
+	assert2 (true, lo:truncate (5))
+	-- the transaction of the object is not joined by other statements
+	assert2 (false, pcall (CONN.execute, CONN, "select 1"))
+	assert2 (true, lo:close ())
+	assert2 (false, lo:close ())
+
+	-- a failure inside the transaction is reported when it ends
+	lo = assert (CONN:lo_open (oid, "rw"))
+	assert2 (1, lo:write "x")
+	assert2 (nil, CONN:lo_export_stream (0, function () end))
+	assert2 (nil, lo:close ())
+
+	local data = {}
+	assert2 (5, CONN:lo_export_stream (oid, function (s)
+		table.insert (data, s)
+	end))
+	assert2 ("hello", table.concat (data))
+
+	assert2 (nil, CONN:lo_import_stream (function () error "failure" end))
+	assert2 (nil, CONN:lo_export_stream (oid, function () error "failure" end))
+	local cur = CUR_OK (CONN:execute (string.format ("select lo_unlink (%d)", oid)))
+	assert2 ("1", cur:fetch ())
+	cur:close ()
+	assert2 (nil, CONN:lo_open (oid))
+	io.write (" large_objects")
+end)
+
+---------------------------------------------------------------------
+-- Transactions begun with the first statement.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	assert (CONN:execute "create temporary table test_lazy (n integer)")
+	assert2 (true, CONN:setautocommit (false))
+	assert2 (true, CONN:commit ())
+	assert2 (true, CONN:rollback ())
+	assert2 (1, CONN:execute "insert into test_lazy values (1)")
+	assert2 (true, CONN:rollback ())
+	assert2 (1, CONN:execute "insert into test_lazy values (2)")
+	assert2 (true, CONN:commit ())
+	local stmt = assert (CONN:prepare (nil, "insert into test_lazy values ($1)"))
+	assert2 (1, stmt:execute (3))
+	assert2 (true, CONN:rollback ())
+	stmt:close ()
+	local cur = CUR_OK (CONN:execute "select sum(n) from test_lazy")
+	assert2 ("2", cur:fetch ())
+	cur:close ()
+	assert2 (true, CONN:setautocommit (true))
+	assert (CONN:execute "drop table test_lazy")
+	io.write (" lazy_begin")
+end)
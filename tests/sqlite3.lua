@@ -16,4 +16,353 @@ end
 
 function checkUnknownDatabase(ENV)
 	-- skip this test
-end
\ No newline at end of file
+end
+
+---------------------------------------------------------------------
+-- Open options and pragmas given at connection time.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	local conn = assert (ENV:connect (":memory:", {
+		timeout = 100, cache_size = -512, temp_store = "memory",
+	}))
+	local cur = CUR_OK (conn:execute "select * from pragma_cache_size")
+	assert2 (-512, cur:fetch ())
+	cur:close ()
+	cur = CUR_OK (conn:execute "select * from pragma_temp_store")
+	assert2 (2, cur:fetch ())
+	cur:close ()
+	assert2 (true, conn:close ())
+
+	local file = os.tmpname ()
+	conn = assert (ENV:connect (file, { journal_mode = "wal", synchronous = "normal" }))
+	cur = CUR_OK (conn:execute "select * from pragma_journal_mode")
+	assert2 ("wal", cur:fetch ())
+	cur:close ()
+	cur = CUR_OK (conn:execute "select * from pragma_synchronous")
+	assert2 (1, cur:fetch ())
+	cur:close ()
+	assert2 (true, conn:close ())
+	os.remove (file)
+	os.remove (file.."-wal")
+	os.remove (file.."-shm")
+
+	assert2 (nil, ENV:connect ("/unknown-data-base", { readonly = true }))
+	io.write (" open_options")
+end)
+
+---------------------------------------------------------------------
+-- Incremental BLOB I/O.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	assert (CONN:execute "create table test_blob (b blob)")
+	assert2 (1, CONN:execute "insert into test_blob values (zeroblob(10))")
+	local rowid = CONN:getlastautoid ()
+	local blob = assert (CONN:blobopen ("test_blob", "b", rowid, true))
+	assert2 (10, blob:size ())
+	assert2 (true, blob:write ("abcde"))
+	assert2 (true, blob:write ("fghij"))
+	assert2 ("cde", blob:read (3, 2))
+	assert2 ("fghij", blob:read ())
+	assert2 (nil, blob:read ())
+	assert2 (false, pcall (blob.read, blob, 1, -1))
+	assert2 (false, pcall (blob.read, blob, 1, 2^32 + 1))
+	assert2 (false, pcall (blob.write, blob, "x", 2^32))
+	assert (not blob:write ("overflow", 8), "blob should not grow")
+	assert2 (false, pcall (CONN.close, CONN), "connection closed with open blob")
+	assert2 (true, blob:close ())
+	assert2 (false, blob:close ())
+	local cur = CUR_OK (CONN:execute "select b from test_blob")
+	assert2 ("abcdefghij", cur:fetch ())
+	cur:close ()
+	assert (CONN:execute "drop table test_blob")
+	io.write (" blob")
+end)
+
+---------------------------------------------------------------------
+-- Lua functions called from SQL.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	assert2 (true, CONN:createfunction ("lua_concat", 2, function (a, b)
+		return tostring(a)..tostring(b)
+	end, true))
+	assert2 (true, CONN:createaggregate ("lua_sum", 1,
+		function (acc, v) return (acc or 0) + v end,
+		function (acc) return acc or 0 end))
+	assert2 (true, CONN:createfunction ("lua_fail", 0, function ()
+		error ("failure")
+	end))
+
+	local cur = CUR_OK (CONN:execute "select lua_concat('a', 1)")
+	assert2 ("a1", cur:fetch ())
+	cur:close ()
+	cur = CUR_OK (CONN:execute "select lua_sum(x) from (select 1 as x union all select 2 union all select 3)")
+	assert2 (6, cur:fetch ())
+	cur:close ()
+	cur = CUR_OK (CONN:execute "select lua_sum(1) where 0")
+	assert2 (0, cur:fetch ())
+	cur:close ()
+	local ok, err = CONN:execute "select lua_fail()"
+	assert2 (nil, ok)
+	assert (string.find (err, "failure", 1, true), "function error message lost: "..tostring (err))
+	io.write (" functions")
+end)
+
+---------------------------------------------------------------------
+-- Online backup into another connection.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	assert (CONN:execute "create table test_backup (x integer)")
+	assert2 (1, CONN:execute "insert into test_backup values (42)")
+	local dest = CONN_OK (ENV:connect (":memory:"))
+	local steps, last = 0
+	assert2 (true, CONN:backup (dest, 1, 0, function (remaining, total)
+		steps = steps + 1
+		last = remaining
+		assert (total > 0, "empty backup")
+	end))
+	assert (steps > 0, "progress function not called")
+	assert2 (0, last)
+	local cur = CUR_OK (dest:execute "select x from test_backup")
+	assert2 (42, cur:fetch ())
+	cur:close ()
+	assert2 (nil, CONN:backup (dest, 1, 0, function () return false end))
+	assert2 (true, dest:close ())
+	assert (CONN:execute "drop table test_backup")
+	io.write (" backup")
+end)
+
+---------------------------------------------------------------------
+-- Database images.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	if not ENV.deserialize then return end
+	local src = CONN_OK (ENV:connect (":memory:"))
+	assert (src:execute "create table test_image (x integer)")
+	assert2 (1, src:execute "insert into test_image values (7)")
+	local image = assert (src:serialize ())
+	assert2 (true, src:close ())
+
+	local copy = CONN_OK (ENV:deserialize (image))
+	assert2 (1, copy:execute "insert into test_image values (8)")
+	local cur = CUR_OK (copy:execute "select sum(x) from test_image")
+	assert2 (15, cur:fetch ())
+	cur:close ()
+	assert2 (true, copy:close ())
+
+	local ro = CONN_OK (ENV:deserialize (image, true))
+	assert2 (nil, ro:execute "insert into test_image values (8)")
+	assert2 (true, ro:close ())
+	io.write (" serialize")
+end)
+
+---------------------------------------------------------------------
+-- Query deadlines.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	local endless = "with recursive c(x) as (select 1 union all select x+1 from c) select count(*) from c"
+	assert2 (true, CONN:setdeadline (10, 100))
+	local res, err = CONN:execute (endless)
+	assert2 (nil, res)
+	assert2 ("LuaSQL: query deadline exceeded", err)
+	-- an expired deadline does not affect later statements
+	local cur = CUR_OK (CONN:execute "select 1")
+	assert2 (1, cur:fetch ())
+	cur:close ()
+	assert2 (true, CONN:setdeadline (60000))
+	assert2 (true, CONN:setdeadline (nil))
+	io.write (" deadline")
+end)
+
+---------------------------------------------------------------------
+-- Busy handler and contention counters.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	assert (CONN:execute "create table test_busy (x integer)")
+	local other = CONN_OK (ENV:connect (datasource, { timeout = 10 }))
+	assert2 (true, other:setbusyhandler (30, 1, 4))
+	assert2 (true, CONN:setautocommit (false))
+	assert2 (1, CONN:execute "insert into test_busy values (1)")
+	assert2 (nil, other:execute "insert into test_busy values (2)")
+	local stats = other:busystats (true)
+	assert2 (1, stats.events)
+	assert (stats.total_wait >= 30 and stats.max_wait >= 30, "lock wait not counted")
+	assert2 (0, other:busystats ().events)
+	assert2 (true, CONN:rollback ())
+	assert2 (true, CONN:setautocommit (true))
+	assert2 (true, other:close ())
+	assert (CONN:execute "drop table test_busy")
+	io.write (" busy")
+end)
+
+---------------------------------------------------------------------
+-- Row counters and statement status.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	assert (CONN:execute "create table test_counters (x integer)")
+	local before = CONN:totalchanges ()
+	assert2 (1, CONN:execute "insert into test_counters (rowid, x) values (4294967297, 1)")
+	assert2 (4294967297, CONN:getlastautoid ())
+	assert2 (1, CONN:execute "insert into test_counters values (2)")
+	assert2 (2, CONN:execute "update test_counters set x = x + 1")
+	assert2 (before + 4, CONN:totalchanges ())
+
+	local cur = CUR_OK (CONN:execute "select x from test_counters where x > 0 order by x")
+	while cur:fetch () do end
+	local status = cur:status ()
+	assert (status.fullscan_step > 0, "full scan not counted")
+	assert2 (1, status.sort)
+	assert (status.vm_step > 0, "steps not counted")
+	assert2 (0, cur:status (true).autoindex)
+	assert2 (0, cur:status ().sort)
+	-- leave a single change behind, drop table reports the last count
+	assert2 (1, CONN:execute "delete from test_counters where x = 3")
+	assert (CONN:execute "drop table test_counters")
+	io.write (" counters")
+end)
+
+---------------------------------------------------------------------
+-- Column information built on first use.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	assert (CONN:execute "create table test_colinfo (a integer, b text)")
+	assert2 (1, CONN:execute "insert into test_colinfo values (1, 'x')")
+	assert2 (1, CONN:execute "insert into test_colinfo values (2, 'y')")
+	local sql = "select a, b from test_colinfo order by a"
+	local function check (names, types)
+		assert2 ("a", names[1])
+		assert2 ("b", names[2])
+		assert2 ("integer", string.lower (types[1]))
+		assert2 ("text", string.lower (types[2]))
+	end
+
+	-- asked before, between and after the fetches
+	local cur = CUR_OK (CONN:execute (sql))
+	local names, types = cur:getcolnames (), cur:getcoltypes ()
+	check (names, types)
+	assert2 (1, cur:fetch ())
+	assert2 (names, cur:getcolnames ())
+	assert2 (types, cur:getcoltypes ())
+	assert2 (2, cur:fetch ())
+	check (cur:getcolnames (), cur:getcoltypes ())
+	assert2 (nil, cur:fetch ())
+	check (names, types)
+
+	-- first asked after an alphanumeric fetch, which builds the names
+	cur = CUR_OK (CONN:execute (sql))
+	assert2 ("x", cur:fetch ({}, "a").b)
+	check (cur:getcolnames (), cur:getcoltypes ())
+	assert2 ("y", cur:fetch ({}, "a").b)
+	names, types = cur:getcolnames (), cur:getcoltypes ()
+	assert2 (true, cur:close ())
+	check (names, types)
+	assert2 (false, pcall (cur.getcolnames, cur))
+	assert (CONN:execute "drop table test_colinfo")
+	io.write (" colinfo")
+end)
+
+---------------------------------------------------------------------
+-- Lua iterators as virtual tables.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	if not CONN.createvtab then return end
+	local data = { { 1, "one" }, { 2, "two" }, { id = 3, name = "three" } }
+	local filters = {}
+	assert2 (true, CONN:createvtab ("lua_numbers", { "id", "name" }, function (constraints)
+		table.insert (filters, constraints)
+		local i = 0
+		return function ()
+			i = i + 1
+			return data[i]
+		end
+	end))
+
+	local cur = CUR_OK (CONN:execute "select name from lua_numbers where id = 3")
+	assert2 ("three", cur:fetch ())
+	assert2 (nil, cur:fetch ())
+	assert2 (3, filters[#filters].id)
+
+	cur = CUR_OK (CONN:execute "select count(*), sum(id) from lua_numbers")
+	local count, sum = cur:fetch ()
+	assert2 (3, count)
+	assert2 (6, sum)
+	cur:close ()
+
+	-- parameters make it a table-valued function
+	assert2 (true, CONN:createvtab ("lua_range", { "value" }, function (args)
+		local i = 0
+		return function ()
+			i = i + 1
+			if i <= args.stop then return { i } end
+		end
+	end, { "stop" }))
+	cur = CUR_OK (CONN:execute "select count(*), sum(value), max(stop) from lua_range(4)")
+	local n, total, stop = cur:fetch ()
+	assert2 (4, n)
+	assert2 (10, total)
+	assert2 (4, stop)
+	cur:close ()
+
+	assert2 (true, CONN:createvtab ("lua_broken", { "x" }, function ()
+		return function () error ("broken iterator", 0) end
+	end))
+	local ok, err = CONN:execute "select x from lua_broken"
+	assert2 (nil, ok)
+	assert (err:find ("broken iterator", 1, true), "wrong error message: "..tostring(err))
+	io.write (" vtab")
+end)
+
+---------------------------------------------------------------------
+-- Columnar fetch.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	local cur = CUR_OK (CONN:execute [[
+		select 1, 'a', 0.5 union all select 2, null, 1.5 union all select 3, 'c', 2.5
+	]])
+	local cols, n = cur:fetchcolumns (2)
+	assert2 (2, n)
+	assert2 (3, #cols)
+	assert2 (2, cols[1][2])
+	assert2 ("a", cols[2][1])
+	assert2 (nil, cols[2][2])
+	assert2 (1.5, cols[3][2])
+	cols, n = cur:fetchcolumns (1)
+	assert2 (1, n)
+	assert2 (3, cols[1][1])
+	assert2 (nil, cur:fetchcolumns ())
+	assert2 (false, cur:close (), MSG_CURSOR_NOT_CLOSED)
+	io.write (" fetchcolumns")
+end)
+
+---------------------------------------------------------------------
+-- Process-wide connection pool.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	local opts = { size = 1, timeout = 20 }
+	local reader = CONN_OK (ENV:checkout (datasource, opts))
+	local cur = CUR_OK (reader:execute "select count(*) from t")
+	assert2 ("number", type(cur:fetch ()))
+	cur:close ()
+	assert2 (nil, reader:execute "create table test_pool (x)")
+	assert2 (nil, reader:createfunction ("f", 0, function () end))
+	local ok, err = ENV:checkout (datasource, opts)
+	assert2 (nil, ok)
+	assert2 ("LuaSQL: pool exhausted", err)
+	assert2 (false, pcall (ENV.checkout, ENV, datasource, { size = 2 }))
+
+	-- changing the schema here would invalidate the statements of CONN
+	local writer = CONN_OK (ENV:checkout (datasource, { write = true }))
+	assert2 (1, writer:execute "insert into t (f1) values ('pool')")
+	assert2 (1, writer:execute "delete from t where f1 = 'pool'")
+	assert2 (true, writer:close ())
+
+	assert2 (true, reader:close ())
+	reader = CONN_OK (ENV:checkout (datasource, opts))
+	assert2 (true, reader:close ())
+	local stats = ENV:poolstats (datasource)
+	assert2 (1, stats.opened)
+	assert2 (1, stats.idle)
+	assert2 (1, stats.timeouts)
+	assert2 (3, stats.checkouts)
+	assert2 (nil, ENV:poolstats ("unknown-pool"))
+	io.write (" pool")
+end)